@@ -17,14 +17,57 @@ class OnewireClient:
     def read_id(self) -> bytes:
         """Reads the Onewire ID."""
 
-        self.c.send("FLUSH")
-
         if self.log is not None:
             self.log("[OneWire]: sending RA")
-        self.c.send("RA")
+        self.c.send("FLUSH;RA")
 
         return self.c.receive()
 
+    def _receive_records(self, marker: int, what: str) -> bytes:
+        """Receives an 8 byte header starting with marker and the 8 byte
+           records following it, the header's second byte is their count"""
+        data = self.c.receive()
+        while len(data) < 8:
+            chunk = self.c.receive()
+            if not chunk:
+                break
+            data += chunk
+
+        if len(data) < 8 or data[0] != marker:
+            raise RuntimeError(f"Invalid {what} response: {data}")
+
+        size = 8 * (data[1] + 1)
+        while len(data) < size:
+            chunk = self.c.receive()
+            if not chunk:
+                raise RuntimeError(f"Truncated {what} response: {data}")
+            data += chunk
+        return data
+
+    def search_roms(self) -> list[bytes]:
+        """Enumerate all devices on the bus with search ROM.
+           Returns the 8 byte ROM IDs"""
+        self.c.send("FLUSH;SR")
+
+        data = self._receive_records(ord("#"), "search ROM")
+
+        count = data[1]
+        return [data[8 * (i + 1):8 * (i + 2)] for i in range(count)]
+
+    def read_all_temperatures(self) -> list[tuple[int, bool, float]]:
+        """Convert on all devices at once and read each of them.
+           Returns (device index, CRC ok, temperature) per device"""
+        self.c.send("FLUSH;BT")
+
+        data = self._receive_records(ord("B"), "batch")
+
+        readings = []
+        for i in range(data[1]):
+            record = data[8 * (i + 1):8 * (i + 2)]
+            raw = int.from_bytes(record[2:4], "little", signed=True)
+            readings.append((record[0], bool(record[1]), raw / 2.0**4))
+        return readings
+
     def set_enable_crc(self, en: bool):
         """Enables the CRC check in the driver."""
         if en:
@@ -38,28 +81,63 @@ class OnewireClient:
 
 
     def read_temperature(self) -> float:
-        """Read the temperature and sets"""
+        """Convert and read the temperature with one request"""
         if self.log is not None:
-            self.log("[OneWire]: sending CT")
+            self.log("[OneWire]: sending CT;RS")
 
-        self.c.send("FLUSH")
-
-        self.c.send("CT")
+        self.c.send("FLUSH;CT;RS")
 
         data = self.c.receive()
         if self.log is not None:
-            self.log(f"[OneWire]: received CT {data}")
+            self.log(f"[OneWire]: received CT;RS {data}")
 
-        if self.log is not None:
-            self.log("[OneWire]: sending RS")
-        self.c.send("RS")
-
-        data = self.c.receive()
-        if self.log is not None:
-            self.log(f"[OneWire]: received RS {data}")
+        # the CT result is '-' followed by the conversion time in ms (u16)
+        if len(data) < 3 + 2 or data[0] != ord("-"):
+            raise RuntimeError(f"Invalid temperature response: {data}")
+        data = data[3:]
 
         b0, b1 = data[0], data[1]
 
         concat = (b1 << 8) + b0
 
         return float(concat) / 2.0**4
+
+    def read_cached_temperature(self, max_age_ms: int | None = None) -> float:
+        """Read the temperature from the server side sample cache.
+           The server only accesses the sensor if the cached value is older than max_age_ms"""
+        if max_age_ms is None:
+            self.c.send("TEMP")
+        else:
+            self.c.send(f"TEMP {int(max_age_ms)}")
+
+        data = self.c.receive()
+        if self.log is not None:
+            self.log(f"[OneWire]: received TEMP {data}")
+
+        fields = data.decode("utf-8").split()
+        if len(fields) < 2 or fields[0] == "ERR":
+            raise RuntimeError(f"No temperature reading available: {data}")
+
+        return float(fields[0])
+
+    def read_history(self, from_ms: int, to_ms: int) -> list[tuple[int, float]]:
+        """Read the stored temperatures between two unix times in ms.
+           Returns a list of (unix time ms, temperature)"""
+        self.c.send(f"HIST {int(from_ms)} {int(to_ms)}")
+
+        data = self.c.receive()
+        while not data.startswith(b"ERR") and not data.endswith(b"END\n"):
+            chunk = self.c.receive()
+            if not chunk:
+                break
+            data += chunk
+
+        if data.startswith(b"ERR"):
+            raise RuntimeError(f"No history available: {data}")
+
+        history = []
+        for line in data.decode("utf-8").splitlines():
+            fields = line.split()
+            if len(fields) == 2:
+                history.append((int(fields[0]), float(fields[1])))
+        return history
@@ -10,8 +10,22 @@
 #include <linux/of.h>              /* For DT*/
 #include <linux/platform_device.h> /* For platform devices */
 
+#include <linux/atomic.h>
+#include <linux/ctype.h>
+#include <linux/idr.h>
 #include <linux/kfifo.h>
+#include <linux/kref.h>
 #include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "constants.h"
+
+#define CREATE_TRACE_POINTS
+#include "onewire_trace.h"
 
 #define MAX_SIZE 128
 
@@ -22,38 +36,176 @@
 #define RESULT_FIFO_SIZE 128
 #define BUFFER_SIZE 512
 
-// Structure to hold device-specific data
-struct onewire_dev
+#define CMD_FIFO_SIZE 32 // commands queued for the bus worker
+#define CMD_SIZE 16      // longest command accepted by write()
+#define CMD_DELIMITER ';' // separates the commands of one write()
+
+#define CONVERSION_POLL_US 1000 // gap between the read slots polling a conversion
+
+#define ROM_SIZE 8
+#define MAX_DEVICES 32 // ROM IDs cached by the search ROM command
+
+#define ONEWIRE_MAX_BUSES 8 // minors of /dev/onewire_devN
+
+// Data structures
+// transaction types counted in sysfs
+enum onewire_op
 {
-    char *kernel_buffer;
-    int buffer_size;
-    struct cdev cdev;
+    ONEWIRE_OP_RESET,
+    ONEWIRE_OP_READ_ROM,
+    ONEWIRE_OP_READ_SCRATCHPAD,
+    ONEWIRE_OP_WRITE_SCRATCHPAD,
+    ONEWIRE_OP_CONVERT,
+    ONEWIRE_OP_SEARCH_ROM,
+    ONEWIRE_OP_BATCH_READ,
+    ONEWIRE_OP_RESOLUTION,
+    ONEWIRE_OP_TRANSACTION, // generic transactions of ONEWIRE_IOC_TRANSACTION
+    ONEWIRE_OP_OTHER, // pin commands, configuration and FIFO commands
+    ONEWIRE_OP_COUNT,
 };
 
-struct gpio_desc *onewire_pin;
-struct gpio_desc *onewire_pin_in;
-static struct onewire_dev *s_dev = NULL;
-static int major_number = 0;
-static struct class *cls;
+// time spent in one bus primitive
+struct onewire_time_stat
+{
+    u64 total_ns;
+    u64 max_ns;
+};
 
-// Data structures
+// results are stored inline in the FIFO, the command path does not allocate
 struct read_data_t
 {
     char data[8];
-    size_t size;
+    u8 size;
+    u8 status; // ONEWIRE_STATUS_*
+    u32 seq;   // sequence number of the command that produced the result
+    u64 timestamp_ns; // ktime_get_ns () when the result was produced
+};
+
+// a command accepted by write(), waiting for the bus worker
+struct onewire_cmd
+{
+    char data[CMD_SIZE];
+    u8 size;
+    u32 seq;
 };
 
-bool resend_false_crc = false;
+// CRC retries: the first one after first_ms, the delay doubles up to
+// max_delay_ms and no retry starts later than deadline_ms after the first attempt
+struct retry_policy
+{
+    unsigned int max_retries;
+    unsigned int first_ms;
+    unsigned int max_delay_ms;
+    unsigned int deadline_ms;
+};
 
 /**
- *  declare a static fifo
- *  According to source DOC the spinlock is not needed, since there is only on reader or writer
- * */
-static DECLARE_KFIFO (result_fifo, struct read_data_t *, RESULT_FIFO_SIZE);
+ * One 1-Wire bus, allocated per device tree node
+ * Every bus has its own character device, lock and FIFO, so several
+ * buses run in parallel
+ * Open files and ring mappings hold a reference, so the state outlives the
+ * removal of the platform device until the last of them is gone
+ */
+struct onewire_dev
+{
+    struct kref ref;
+    struct gpio_desc *pin; // NULL once removed
+    bool removed;          // set under bus_mutex when the platform device is removed
+    int minor;
+    dev_t devt;
+    struct cdev *cdev;
+
+    char *kernel_buffer;
+    int buffer_size;
+    struct mutex write_mutex; // guards kernel_buffer
+
+    /**
+     * write() only validates and queues a command, the ordered workqueue runs
+     * the queued commands one after the other and owns the bus meanwhile
+     */
+    struct workqueue_struct *cmd_queue;
+    struct work_struct cmd_work;
+    DECLARE_KFIFO (cmd_fifo, struct onewire_cmd, CMD_FIFO_SIZE);
+    spinlock_t cmd_lock;         // writers of cmd_fifo
+    wait_queue_head_t cmd_space; // writers waiting for a free command slot
+
+    // sequence numbers of the last queued and the last finished command
+    u32 seq_submitted;
+    u32 seq_completed;
+    u32 seq_running; // stored in the results of the running command
+    wait_queue_head_t seq_wait;
+
+    /**
+     * The bus worker is the only writer, the readers and FLUSH run
+     * concurrently to it and to each other
+     * */
+    DECLARE_KFIFO (result_fifo, struct read_data_t, RESULT_FIFO_SIZE);
+    spinlock_t result_lock; // readers of result_fifo, FLUSH and switching between FIFO and ring
+    unsigned long results_dropped; // results lost because the FIFO was full
+
+    // readers sleeping until a result is queued
+    wait_queue_head_t result_wait;
+
+    // results go to the ring instead of the FIFO while it is mapped
+    struct onewire_ring *ring;
+    atomic_t ring_maps;
+    u32 ring_head; // the driver's copy, the one in the ring is only written
+
+    struct mutex open_mutex;
+    int device_opened;
+
+    // one transaction at a time, write() and ioctl() share the bus
+    struct mutex bus_mutex;
+
+    bool resend_false_crc;
+    struct retry_policy retry_policy;
+
+    // ROM IDs found by the last search ROM
+    uint8_t rom_ids[MAX_DEVICES][ROM_SIZE];
+    int rom_count;
+
+    // resolution in bits of the devices in rom_ids, 0 if not known
+    u8 rom_resolution[MAX_DEVICES];
+    // resolution assumed for skip ROM and unknown devices
+    u8 bus_resolution;
+
+    // statistics reported by ONEWIRE_IOC_GET_STATS
+    u64 stat_transactions;
+    u64 stat_resets;
+    u64 stat_crc_errors;   // every failed CRC check
+    u64 stat_retries;      // attempts repeated after a CRC error
+    u64 stat_crc_failures; // transactions that still failed after all retries
+    u64 stat_no_presence;  // resets without a presence pulse
+    u64 stat_bus_short;    // resets that found the line stuck low
+
+    // time the bit engine ran with local IRQs disabled
+    u64 stat_irq_off_ns;      // total
+    u64 stat_irq_off_last_ns; // of the last transaction
+    u64 stat_irq_off_max_ns;  // of the longest transaction
+    u64 transaction_irq_off_ns;
+
+    // statistics only exported in sysfs, see onewire_stats_attrs
+    u64 stat_ops[ONEWIRE_OP_COUNT];
+    u64 stat_bytes_written;
+    u64 stat_bytes_read;
+    unsigned int stat_fifo_max; // FIFO high-water mark
+    struct onewire_time_stat stat_write_cmd;
+    struct onewire_time_stat stat_read_cmd;
+    struct onewire_time_stat stat_reset;
+};
 
-// define a mutex
-static DEFINE_MUTEX (open_mutex);
-static int device_opened;
+static dev_t onewire_devt;
+static struct class *cls;
+// minor -> bus, the entry is NULL from the removal until the last reference is gone
+static DEFINE_IDR (onewire_idr);
+static DEFINE_MUTEX (onewire_idr_lock);
+
+static const struct retry_policy default_retry_policy = {
+    .max_retries = 5,
+    .first_ms = 2,
+    .max_delay_ms = 50,
+    .deadline_ms = 200,
+};
 
 const char bit_mask[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
 
@@ -78,18 +230,117 @@ static const uint8_t onewire_crc8_table[256] = {
 };
 
 /**
- * Adds a response to the FIFO
+ * returns true while userspace has the result ring mapped
+ */
+static bool
+ring_mapped (struct onewire_dev *dev)
+{
+    return atomic_read (&dev->ring_maps) > 0;
+}
+
+/**
+ * Number of results in the ring
+ * tail is written by userspace, a value that does not fit counts as full
+ */
+static u32
+ring_len (struct onewire_dev *dev)
+{
+    u32 len = dev->ring_head - smp_load_acquire (&dev->ring->header.tail);
+    return min_t (u32, len, ONEWIRE_RING_RECORDS);
+}
+
+/**
+ * Results waiting in the FIFO and, while it is mapped, the ring
+ */
+static unsigned int
+results_pending (struct onewire_dev *dev)
+{
+    return kfifo_len (&dev->result_fifo) + (ring_mapped (dev) ? ring_len (dev) : 0);
+}
+
+/**
+ * Publishes a result at the head of the ring
+ * returns -ENOSPC if the ring is full
+ */
+static int
+ring_put (struct onewire_dev *dev, const struct read_data_t *result)
+{
+    struct onewire_ring_header *header = &dev->ring->header;
+
+    if (ring_len (dev) >= ONEWIRE_RING_RECORDS)
+    {
+        header->dropped++;
+        return -ENOSPC;
+    }
+
+    struct onewire_ioc_result *record = &dev->ring->record[dev->ring_head % ONEWIRE_RING_RECORDS];
+    record->seq = result->seq;
+    record->status = result->status;
+    record->size = result->size;
+    record->timestamp_ns = result->timestamp_ns;
+    memcpy (record->data, result->data, sizeof (record->data));
+
+    // the record is complete before userspace sees the new head
+    smp_store_release (&header->head, ++dev->ring_head);
+    return 0;
+}
+
+/**
+ * Adds a result record to the FIFO, or to the ring while it is mapped
+ * size is at most 8
+ * returns -ENOSPC and counts the result as dropped if there is no space
  */
-static write_response_char(char c) {
-    struct read_data_t *result = kmalloc (sizeof (struct read_data_t), GFP_KERNEL);
-    for (int i = 0; i < 8; i++)
+static int
+write_response (struct onewire_dev *dev, const char *data, size_t size, u8 status)
+{
+    struct read_data_t result = { 0 };
+
+    memcpy (result.data, data, min (size, sizeof (result.data)));
+    result.size = min (size, sizeof (result.data));
+    result.status = status;
+    result.seq = dev->seq_running;
+    result.timestamp_ns = ktime_get_ns ();
+
+    // the last munmap must not clear the ring between the check and the put
+    unsigned long flags;
+    spin_lock_irqsave (&dev->result_lock, flags);
+    int full = ring_mapped (dev) ? ring_put (dev, &result) : !kfifo_put (&dev->result_fifo, result);
+    spin_unlock_irqrestore (&dev->result_lock, flags);
+    if (full)
     {
-        result->data[i] = 0;
+        dev->results_dropped++;
+        return -ENOSPC;
     }
-    result->data[0] = c;
-    result->size = 8;
+    dev->stat_fifo_max = max (dev->stat_fifo_max, results_pending (dev));
+
+    wake_up_interruptible (&dev->result_wait);
+    return 0;
+}
+
+/**
+ * Takes the oldest result from the FIFO
+ * returns false if the FIFO is empty
+ */
+static bool
+take_result (struct onewire_dev *dev, struct read_data_t *result)
+{
+    unsigned long flags;
 
-    kfifo_put (&result_fifo, result); 
+    spin_lock_irqsave (&dev->result_lock, flags);
+    bool found = kfifo_get (&dev->result_fifo, result);
+    spin_unlock_irqrestore (&dev->result_lock, flags);
+
+    return found;
+}
+
+/**
+ * Adds a single character response to the FIFO
+ */
+static int
+write_response_char (struct onewire_dev *dev, char c)
+{
+    char data[8] = { c };
+    return write_response (dev, data, sizeof (data), ONEWIRE_STATUS_OK);
 }
 
 /**
@@ -124,49 +375,154 @@ compute_crc (const uint8_t *data, size_t len)
     return crc;
 }
 
+/**
+ * compute the 1-Wire CRC16 (polynomial 0x8005, LSB first, initial value 0)
+ */
+static u16
+compute_crc16 (const uint8_t *data, size_t len)
+{
+    u16 crc = 0;
+    while (len--)
+    {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+/**
+ * Disables local IRQs for the timing critical part of a slot
+ * returns the start time to pass to irq_off_end
+ */
+static u64
+irq_off_begin (struct onewire_dev *dev, unsigned long *flags)
+{
+    local_irq_save (*flags);
+    return ktime_get_ns ();
+}
+
+static void
+irq_off_end (struct onewire_dev *dev, unsigned long flags, u64 start)
+{
+    dev->transaction_irq_off_ns += ktime_get_ns () - start;
+    local_irq_restore (flags);
+}
+
+/**
+ * Every write() command and ioctl is one transaction
+ */
+static void
+transaction_begin (struct onewire_dev *dev)
+{
+    dev->transaction_irq_off_ns = 0;
+}
+
+static void
+transaction_end (struct onewire_dev *dev, enum onewire_op op)
+{
+    dev->stat_transactions++;
+    dev->stat_ops[op]++;
+    dev->stat_irq_off_ns += dev->transaction_irq_off_ns;
+    dev->stat_irq_off_last_ns = dev->transaction_irq_off_ns;
+    dev->stat_irq_off_max_ns = max (dev->stat_irq_off_max_ns, dev->transaction_irq_off_ns);
+}
+
+/**
+ * Adds the time since start to a bus primitive statistic
+ */
+static void
+note_time (struct onewire_time_stat *stat, ktime_t start)
+{
+    u64 ns = ktime_to_ns (ktime_sub (ktime_get (), start));
+
+    stat->total_ns += ns;
+    stat->max_ns = max (stat->max_ns, ns);
+}
+
+/**
+ * Write a single bit time slot
+ * Only the part of a slot with an upper time limit is protected, the
+ * recovery time after the slot sleeps
+ */
+static void
+write_bit (struct onewire_dev *dev, int bit)
+{
+    if (bit)
+    {
+        // the line has to be released within 15 us
+        unsigned long flags;
+        u64 start = irq_off_begin (dev, &flags);
+        gpiod_direction_output (dev->pin, 0);
+        udelay (7);
+        gpiod_direction_input (dev->pin);
+        irq_off_end (dev, flags, start);
+
+        usleep_range (60, 80);
+    }
+    else
+    {
+        // low for 60 to 120 us, an interrupt could stretch it past 120 us
+        // and a long enough low pulse is seen as a reset by the devices
+        unsigned long flags;
+        u64 start = irq_off_begin (dev, &flags);
+        gpiod_direction_output (dev->pin, 0);
+        udelay (60);
+        gpiod_direction_input (dev->pin);
+        irq_off_end (dev, flags, start);
+
+        usleep_range (15, 30);
+    }
+}
+
+/**
+ * Read a single bit time slot
+ * IRQs are disabled from the start of the slot until the line is sampled
+ */
+static int
+read_bit (struct onewire_dev *dev)
+{
+    unsigned long flags;
+    u64 start = irq_off_begin (dev, &flags);
+
+    gpiod_direction_output (dev->pin, 0);
+    udelay (9);
+
+    gpiod_direction_input (dev->pin);
+
+    udelay (15);
+    int rd = gpiod_get_value (dev->pin);
+    irq_off_end (dev, flags, start);
+
+    usleep_range (60, 80);
+    return rd;
+}
+
 /**
  * Write data to the 1-Wire lane
  */
 static int
-write_cmd (struct gpio_desc *request, char *data, size_t length)
+write_cmd (struct onewire_dev *dev, char *data, size_t length)
 {
-    printk ("Write CMD \n");
+    ktime_t start = ktime_get ();
 
-    gpiod_direction_input (request);
+    gpiod_direction_input (dev->pin);
     // iterate over each byte
     for (int i = 0; i < length; i++)
     {
+        trace_onewire_write_byte (data[i]);
         // iterate over each bit
         for (int j = 0; j < 8; j++)
         {
-            unsigned long flags;
-
-            if (data[i] & bit_mask[j])
-            {
-                local_irq_save (flags);
-                // printk ("Write 1 \n");
-                gpiod_direction_output (request, 0);
-                udelay (7);
-
-                gpiod_direction_input (request);
-                local_irq_restore (flags);
-                udelay (60);
-            }
-            else
-            {
-                local_irq_save (flags);
-                // printk ("Write 0 \n");
-                gpiod_direction_output (request, 0);
-                udelay (60);
-                gpiod_direction_input (request);
-                local_irq_restore (flags);
-                udelay (15);
-            }
+            write_bit (dev, data[i] & bit_mask[j]);
         }
-        udelay (30);
     }
-    gpiod_direction_input (request);
+    gpiod_direction_input (dev->pin);
 
+    dev->stat_bytes_written += length;
+    note_time (&dev->stat_write_cmd, start);
     return 0;
 }
 
@@ -175,406 +531,1626 @@ write_cmd (struct gpio_desc *request, char *data, size_t length)
  * Reads exactly length*8 bits
  * "data" format is little endian
  */
-static uint8_t
-read_cmd (struct gpio_desc *request, char *data, size_t length)
+static void
+read_bytes (struct onewire_dev *dev, char *data, size_t length)
 {
-    printk("read_cmd \n");
-    unsigned long flags;
-    local_irq_save (flags);
+    ktime_t start = ktime_get ();
 
     for (int i = 0; i < length; i++)
     {
         char read_bits = 0;
         for (int j = 0; j < 8; j++)
         {
-
-            gpiod_direction_output (request, 0);
-            udelay (9);
-
-            gpiod_direction_input (request);
-
-            udelay (15);
-            int rd = gpiod_get_value (request);
+            int rd = read_bit (dev);
 
             if (rd == 0)
             {
-                printk ("Read 0 \n");
                 read_bits = read_bits >> 1;
             }
             else
             {
-                printk ("Read 1 \n");
                 read_bits = (read_bits >> 1) | 0x80; // put a '1' at bit 7
             }
-
-            udelay (60);
         }
         data[i] = read_bits;
-        printk ("------ readd data %x  -------------\n", read_bits);
+        trace_onewire_read_byte (read_bits);
     }
-    local_irq_restore (flags);
-    gpiod_direction_input (request);
+    gpiod_direction_input (dev->pin);
+
+    dev->stat_bytes_read += length;
+    note_time (&dev->stat_read_cmd, start);
+}
+
+/**
+ * Reads length bytes, the last one is the CRC8 of the others
+ * returns 1 if the CRC matches
+ */
+static uint8_t
+read_cmd (struct onewire_dev *dev, char *data, size_t length)
+{
+    read_bytes (dev, data, length);
 
-    for (int i = 0; i < length; i++)
-    {
-        printk ("%x ", data[i]);
-    }
     uint8_t crc = compute_crc (data, length - 1);
+    trace_onewire_crc (crc, data[length - 1]);
 
     uint8_t res = crc == data[length - 1];
+    if (!res)
+    {
+        dev->stat_crc_errors++;
+    }
     return res;
 }
 
 /**
  * 1-Wire reset
- * Pull down for 500 US
+ * Pull down for 500 US, a longer pulse does no harm so the CPU is yielded
+ * The devices answer 15 to 60 us after the release with a 60 to 240 us
+ * presence pulse, the line is sampled 70 us after the release. At the end
+ * of the 500 us presence window the line has to be released again.
+ * returns ONEWIRE_STATUS_OK, ONEWIRE_STATUS_NO_DEVICE or ONEWIRE_STATUS_BUS_SHORT
  */
-static void
-reset (struct gpio_desc *request)
+static u8
+reset (struct onewire_dev *dev)
 {
-    printk ("run reset \n");
+    ktime_t start = ktime_get ();
+    u8 status = ONEWIRE_STATUS_OK;
+    dev->stat_resets++;
 
-    gpiod_direction_output (request, 1);
-    gpiod_set_value (request, 0);
+    gpiod_direction_output (dev->pin, 1);
+    gpiod_set_value (dev->pin, 0);
 
-    udelay (500);
+    usleep_range (500, 600);
 
-    gpiod_set_value (request, 1);
+    gpiod_set_value (dev->pin, 1);
+
+    unsigned long flags;
+    u64 irq_start = irq_off_begin (dev, &flags);
+    gpiod_direction_input (dev->pin);
+    udelay (70);
+    int presence = !gpiod_get_value (dev->pin);
+    irq_off_end (dev, flags, irq_start);
 
-    gpiod_direction_input (request);
+    usleep_range (430, 530);
 
-    // int ret = wait_until_rising_edge (request);
-    // printk ("ret wait %i \n", ret);
+    if (!gpiod_get_value (dev->pin))
+    {
+        dev->stat_bus_short++;
+        status = ONEWIRE_STATUS_BUS_SHORT;
+    }
+    else if (!presence)
+    {
+        dev->stat_no_presence++;
+        status = ONEWIRE_STATUS_NO_DEVICE;
+    }
 
-    udelay (500);
+    note_time (&dev->stat_reset, start);
+    trace_onewire_reset (ktime_us_delta (ktime_get (), start), status);
+    return status;
 }
 
 /**
- * Handles the device open operation
- * locks the driver from accesses to other processes
+ * 1-Wire search ROM (0xF0)
+ * Walks the binary tree of all ROM IDs on the bus, for each of the 64 bits
+ * the devices send the bit and its complement and the master selects the
+ * branch to follow. Found IDs are stored in dev->rom_ids.
+ * returns the number of devices or -EIO if the bus answered inconsistently
+ * or stopped answering the reset
  */
 static int
-onewire_open (struct inode *inode, struct file *filp)
+search_rom (struct onewire_dev *dev)
 {
-    printk (KERN_INFO "%s: Device opened\n", MODULE_NAME);
-
-    // check if the device is already opened
-    if (mutex_lock_interruptible (&open_mutex))
-        return -ERESTARTSYS;
+    uint8_t rom[ROM_SIZE] = { 0 };
+    int last_discrepancy = 0;
+    int count = 0;
 
-    if (device_opened)
+    do
     {
-        mutex_unlock (&open_mutex);
-        return -EBUSY;
-    }
+        int last_zero = 0;
+        bool found = true;
 
-    // grab the device
-    device_opened = true;
-    mutex_unlock (&open_mutex);
+        u8 status = reset (dev);
+        if (status == ONEWIRE_STATUS_NO_DEVICE && count == 0)
+        { // empty bus
+            break;
+        }
+        if (status != ONEWIRE_STATUS_OK)
+        {
+            return -EIO;
+        }
 
-    return 0;
-}
+        char data[1] = { 0xF0 };
+        write_cmd (dev, data, 1);
 
-/**
- * Handles the device release operation
- * frees the driver lock
- */
-static int
-onewire_release (struct inode *inode, struct file *filp)
-{
-    printk (KERN_INFO "%s: Device released\n", MODULE_NAME);
+        for (int bit_number = 1; bit_number <= 64; bit_number++)
+        {
+            int byte = (bit_number - 1) / 8;
+            uint8_t mask = bit_mask[(bit_number - 1) % 8];
 
-    // release the device
-    mutex_lock (&open_mutex);
-    device_opened = false;
-    mutex_unlock (&open_mutex);
+            int id_bit = read_bit (dev);
+            int cmp_id_bit = read_bit (dev);
 
-    return 0;
+            if (id_bit && cmp_id_bit)
+            { // no device answered
+                found = false;
+                break;
+            }
+
+            int direction;
+            if (id_bit != cmp_id_bit)
+            { // all remaining devices have the same bit
+                direction = id_bit;
+            }
+            else
+            { // discrepancy, take the branch not taken in the last pass
+                if (bit_number < last_discrepancy)
+                    direction = (rom[byte] & mask) != 0;
+                else
+                    direction = bit_number == last_discrepancy;
+
+                if (!direction)
+                    last_zero = bit_number;
+            }
+
+            if (direction)
+                rom[byte] |= mask;
+            else
+                rom[byte] &= ~mask;
+
+            write_bit (dev, direction);
+        }
+
+        if (!found)
+        {
+            break;
+        }
+
+        if (compute_crc (rom, ROM_SIZE - 1) != rom[ROM_SIZE - 1])
+        {
+            pr_err ("%s: search ROM got an invalid ROM ID\n", MODULE_NAME);
+            return -EIO;
+        }
+        memcpy (dev->rom_ids[count], rom, ROM_SIZE);
+        count++;
+
+        last_discrepancy = last_zero;
+    } while (last_discrepancy != 0 && count < MAX_DEVICES);
+
+    dev->rom_count = count;
+    memset (dev->rom_resolution, 0, sizeof (dev->rom_resolution));
+    return count;
 }
 
 /**
- * Reads an element from the KFIFO and returns its content to the user space
+ * Puts the ROM command addressing rom into data,
+ * match ROM with the ROM ID or skip ROM if rom is NULL
+ * returns the number of bytes used
  */
-static ssize_t
-onewire_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static size_t
+address_device (char *data, const uint8_t *rom)
 {
-    printk ("READ \n");
-
-    printk ("f_pos %p count %zu \n", f_pos, count);
-
-    // read the fifo data
-    struct read_data_t *result;
-    int processed_elements = kfifo_get (&result_fifo, &result);
-    printk ("ptr_adr %p processed_elements %i \n", result, processed_elements);
-    if (processed_elements == 0)
-    { // if fifo was empty stop reading
-        return 0;
-    }
-
-    // copy the fifo to the buffer
-    // result->size is always < 8
-    // so always enough data in the kernl_buffer
-    for (size_t i = 0; i < result->size; i++)
+    if (rom)
     {
-        printk ("c %x ", result->data[i]);
-        s_dev->kernel_buffer[i] = result->data[i];
+        data[0] = 0x55; // match ROM
+        memcpy (data + 1, rom, ROM_SIZE);
+        return 1 + ROM_SIZE;
     }
 
-    // boundary checks
-    size_t min_count = min (count, result->size);
-    if (count < result->size)
+    data[0] = 0xCC; // skip ROM
+    return 1;
+}
+
+/**
+ * Called after attempt retry (counted from 0) of a transaction failed its
+ * CRC check, sleeps until the next attempt
+ * returns false if retries are disabled or the policy allows no further one
+ */
+static bool
+retry_after_crc_error (struct onewire_dev *dev, unsigned int retry, ktime_t start)
+{
+    if (!dev->resend_false_crc || retry >= dev->retry_policy.max_retries)
     {
-        pr_warn ("%s: userspace buffer is too small (%zu < %zu)\n", MODULE_NAME, count, min_count);
+        return false;
     }
 
-    printk ("result size %u min_count %u \n", result->size, min_count);
-    if (copy_to_user (buf, s_dev->kernel_buffer, min_count))
+    unsigned int delay_ms
+        = min (dev->retry_policy.first_ms << min (retry, 16u), dev->retry_policy.max_delay_ms);
+    if (ktime_ms_delta (ktime_get (), start) + delay_ms > dev->retry_policy.deadline_ms)
     {
-        return -EFAULT; // Failed to copy to user space
+        return false;
     }
 
-    kfree (result);
-
-    *f_pos += min_count;
-    return min_count;
+    dev->stat_retries++;
+    usleep_range (delay_ms * 1000, delay_ms * 1000 + 500);
+    return true;
 }
 
 /**
- * Handles the write operation from user space
- * It interprets the characters and runs the according operation
- * not all operations are 1-Wire related
+ * Reads the ROM ID of the only device on the bus (read ROM)
+ * With CRC checking enabled the whole transaction is repeated on a CRC error,
+ * a failed reset aborts it right away
+ * returns ONEWIRE_STATUS_*
  */
-static ssize_t
-onewire_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static u8
+read_rom (struct onewire_dev *dev, char *data_read)
 {
-    ssize_t bytes_written = 0;
+    ktime_t start = ktime_get ();
+    int crc_correct;
+    for (unsigned int retry = 0;; retry++)
+    {
+        u8 status = reset (dev);
+        if (status != ONEWIRE_STATUS_OK)
+        {
+            return status;
+        }
 
-    pr_info ("copy count %u f_pos %llu \n", count, *f_pos);
+        char data[1] = { 0x33 };
+        write_cmd (dev, data, 1);
 
-    // verify there is not more written than buffer space is available
-    if (count > s_dev->buffer_size - *f_pos)
-    {
-        count = s_dev->buffer_size - *f_pos;
+        usleep_range (500, 600);
+
+        crc_correct = read_cmd (dev, data_read, ROM_SIZE);
+        if (crc_correct || !retry_after_crc_error (dev, retry, start))
+            break;
     }
 
-    if (copy_from_user (s_dev->kernel_buffer + *f_pos, buf, count))
+    if (!crc_correct)
     {
-        return -EFAULT; // Failed to copy from user space
+        dev->stat_crc_failures++;
+        return ONEWIRE_STATUS_CRC_ERROR;
     }
+    return ONEWIRE_STATUS_OK;
+}
 
-    pr_info ("copy_from user space scceeded\n");
-    *f_pos += count;
-    bytes_written = count;
+/**
+ * Reads the 9 byte scratchpad of the device with the given ROM ID,
+ * or of the only device on the bus if rom is NULL (skip ROM)
+ * With CRC checking enabled the whole transaction is repeated on a CRC error,
+ * a failed reset aborts it right away
+ * returns ONEWIRE_STATUS_*
+ */
+static u8
+read_scratchpad (struct onewire_dev *dev, const uint8_t *rom, char *data_read)
+{
+    char data[ROM_SIZE + 2];
+    size_t length = address_device (data, rom);
+    data[length++] = 0xBE;
 
-    if (kfifo_is_full (&result_fifo))
+    ktime_t start = ktime_get ();
+    int crc_correct;
+    for (unsigned int retry = 0;; retry++)
     {
-        pr_err ("Error kenel fifo is full. Can not write data");
-        return -EFAULT;
+        u8 status = reset (dev);
+        if (status != ONEWIRE_STATUS_OK)
+        {
+            return status;
+        }
+
+        write_cmd (dev, data, length);
+
+        usleep_range (600, 700);
+
+        crc_correct = read_cmd (dev, data_read, 8 + 1);
+        if (crc_correct || !retry_after_crc_error (dev, retry, start))
+            break;
     }
 
-    if (count > 0)
+    if (!crc_correct)
     {
-        if (s_dev->kernel_buffer[0] == 'r')
-        {
-            reset (onewire_pin);
-            write_response_char('r');
-        }
-        else if (s_dev->kernel_buffer[0] == 'h')
-        {
-            gpiod_direction_output (onewire_pin, 1);
-            gpiod_set_value (onewire_pin, 1);
-            write_response_char('h');
+        dev->stat_crc_failures++;
+        return ONEWIRE_STATUS_CRC_ERROR;
+    }
+    return ONEWIRE_STATUS_OK;
+}
+
+/**
+ * Nominal DS18B20 conversion time, 750 ms at 12 bit, halved for every bit less
+ */
+static unsigned int
+conversion_time_ms (u8 bits)
+{
+    return DIV_ROUND_UP (750, 1 << (ONEWIRE_RESOLUTION_MAX - bits));
+}
+
+/**
+ * Resolution bits (R1, R0) of the configuration register
+ */
+static u8
+config_resolution (u8 config)
+{
+    return ONEWIRE_RESOLUTION_MIN + ((config >> 5) & 0x3);
+}
+
+static u8
+resolution_config (u8 bits)
+{
+    return ((bits - ONEWIRE_RESOLUTION_MIN) << 5) | 0x1F;
+}
+
+/**
+ * returns the index of rom in dev->rom_ids or -1
+ */
+static int
+rom_index (struct onewire_dev *dev, const uint8_t *rom)
+{
+    for (int i = 0; i < dev->rom_count; i++)
+    {
+        if (memcmp (dev->rom_ids[i], rom, ROM_SIZE) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the resolution of a device
+ * For skip ROM all devices convert, so it is the highest resolution on the bus
+ */
+static u8
+resolution_of (struct onewire_dev *dev, const uint8_t *rom)
+{
+    if (!rom)
+    {
+        u8 bits = dev->bus_resolution;
+        for (int i = 0; i < dev->rom_count; i++)
+        {
+            bits = max (bits, dev->rom_resolution[i]);
+        }
+        return bits;
+    }
+
+    int i = rom_index (dev, rom);
+    if (i >= 0 && dev->rom_resolution[i])
+    {
+        return dev->rom_resolution[i];
+    }
+    return dev->bus_resolution;
+}
+
+/**
+ * Remembers the resolution of a device, or of all devices if rom is NULL
+ */
+static void
+note_resolution (struct onewire_dev *dev, const uint8_t *rom, u8 bits)
+{
+    if (!rom)
+    {
+        dev->bus_resolution = bits;
+        memset (dev->rom_resolution, bits, sizeof (dev->rom_resolution));
+        return;
+    }
+
+    int i = rom_index (dev, rom);
+    if (i >= 0)
+    {
+        dev->rom_resolution[i] = bits;
+    }
+}
+
+/**
+ * Writes TH, TL and the configuration register of a device (write scratchpad)
+ * returns ONEWIRE_STATUS_*
+ */
+static u8
+write_scratchpad (struct onewire_dev *dev, const uint8_t *rom, u8 th, u8 tl, u8 config)
+{
+    char data[ROM_SIZE + 5];
+    size_t length = address_device (data, rom);
+    data[length++] = 0x4E;
+    data[length++] = th;
+    data[length++] = tl;
+    data[length++] = config;
+
+    u8 status = reset (dev);
+    if (status == ONEWIRE_STATUS_OK)
+    {
+        write_cmd (dev, data, length);
+    }
+    return status;
+}
+
+/**
+ * Copies TH, TL and the configuration register to the EEPROM (copy scratchpad)
+ * returns ONEWIRE_STATUS_*
+ */
+static u8
+copy_scratchpad (struct onewire_dev *dev, const uint8_t *rom)
+{
+    char data[ROM_SIZE + 2];
+    size_t length = address_device (data, rom);
+    data[length++] = 0x48;
+
+    u8 status = reset (dev);
+    if (status != ONEWIRE_STATUS_OK)
+    {
+        return status;
+    }
+    write_cmd (dev, data, length);
+
+    // the EEPROM write takes up to 10 ms
+    msleep (10);
+    return ONEWIRE_STATUS_OK;
+}
+
+/**
+ * Sets the resolution of a device, or of all devices if rom is NULL
+ * TH and TL are read first and written back unchanged, with persist the
+ * setting is copied to the EEPROM and survives a power cycle
+ * returns ONEWIRE_STATUS_*
+ */
+static u8
+set_resolution (struct onewire_dev *dev, const uint8_t *rom, u8 bits, bool persist)
+{
+    char scratchpad[9];
+    u8 status = read_scratchpad (dev, rom, scratchpad);
+    if (status != ONEWIRE_STATUS_OK)
+    {
+        return status;
+    }
+
+    status = write_scratchpad (dev, rom, scratchpad[2], scratchpad[3], resolution_config (bits));
+    if (status == ONEWIRE_STATUS_OK && persist)
+    {
+        status = copy_scratchpad (dev, rom);
+    }
+    if (status != ONEWIRE_STATUS_OK)
+    {
+        return status;
+    }
+
+    note_resolution (dev, rom, bits);
+    return ONEWIRE_STATUS_OK;
+}
+
+/**
+ * Reads the resolution from the configuration register
+ * returns ONEWIRE_STATUS_*
+ */
+static u8
+get_resolution (struct onewire_dev *dev, const uint8_t *rom, u8 *bits)
+{
+    char scratchpad[9];
+    u8 status = read_scratchpad (dev, rom, scratchpad);
+    if (status != ONEWIRE_STATUS_OK)
+    {
+        return status;
+    }
+
+    *bits = config_resolution (scratchpad[4]);
+    note_resolution (dev, rom, *bits);
+    return ONEWIRE_STATUS_OK;
+}
+
+/**
+ * Starts a temperature conversion on one device, or all if rom is NULL, and
+ * waits until it is done
+ * While converting the devices answer read slots with 0, the slots are
+ * repeated every CONVERSION_POLL_US so the wait follows the actual
+ * conversion time. The timeout follows the configured resolution.
+ * returns ONEWIRE_STATUS_*, elapsed_us is set to the conversion time
+ */
+static u8
+convert (struct onewire_dev *dev, const uint8_t *rom, unsigned int *elapsed_us)
+{
+    char data[ROM_SIZE + 2];
+    size_t length = address_device (data, rom);
+    data[length++] = 0x44;
+
+    *elapsed_us = 0;
+    u8 status = reset (dev);
+    if (status != ONEWIRE_STATUS_OK)
+    {
+        return status;
+    }
+    write_cmd (dev, data, length);
+
+    ktime_t start = ktime_get ();
+    ktime_t deadline = ktime_add_ms (start, conversion_time_ms (resolution_of (dev, rom)) * 4 / 3);
+    int done = 0;
+    while (!done)
+    {
+        usleep_range (CONVERSION_POLL_US, 2 * CONVERSION_POLL_US);
+
+        done = read_bit (dev);
+
+        if (!done && ktime_after (ktime_get (), deadline))
+        {
+            break;
+        }
+    }
+
+    *elapsed_us = ktime_us_delta (ktime_get (), start);
+    trace_onewire_convert (*elapsed_us, done);
+
+    return done ? ONEWIRE_STATUS_OK : ONEWIRE_STATUS_TIMEOUT;
+}
+
+/**
+ * Checks the CRC of a generic transaction
+ * The span and the CRC after it are taken from the written bytes followed
+ * by the read bytes, the CRC16 is sent inverted, LSB first
+ * returns true if the CRC matches
+ */
+static bool
+transaction_crc_ok (struct onewire_dev *dev, const struct onewire_ioc_transaction *t)
+{
+    uint8_t stream[2 * ONEWIRE_TRANSACTION_MAX];
+    bool ok;
+
+    memcpy (stream, t->write_data, t->write_len);
+    memcpy (stream + t->write_len, t->read_data, t->read_len);
+
+    const uint8_t *span = stream + t->crc_start;
+    if (t->crc == ONEWIRE_CRC8)
+    {
+        uint8_t crc = compute_crc (span, t->crc_len);
+        trace_onewire_crc (crc, span[t->crc_len]);
+        ok = crc == span[t->crc_len];
+    }
+    else
+    {
+        u16 crc = ~compute_crc16 (span, t->crc_len);
+        ok = crc == (span[t->crc_len] | (span[t->crc_len + 1] << 8));
+    }
+
+    if (!ok)
+    {
+        dev->stat_crc_errors++;
+    }
+    return ok;
+}
+
+/**
+ * returns true if the lengths and the CRC span of a generic transaction fit
+ * The CRC bytes have to be read from the device
+ */
+static bool
+transaction_valid (const struct onewire_ioc_transaction *t)
+{
+    if (t->flags & ~(ONEWIRE_TRANSACTION_RESET | ONEWIRE_TRANSACTION_NO_RETRY)
+        || t->write_len > ONEWIRE_TRANSACTION_MAX
+        || t->read_len > ONEWIRE_TRANSACTION_MAX)
+    {
+        return false;
+    }
+
+    if (t->crc == ONEWIRE_CRC_NONE)
+    {
+        return true;
+    }
+    if (t->crc != ONEWIRE_CRC8 && t->crc != ONEWIRE_CRC16)
+    {
+        return false;
+    }
+
+    unsigned int crc_size = t->crc == ONEWIRE_CRC8 ? 1 : 2;
+    unsigned int crc_at = t->crc_start + t->crc_len;
+    return crc_at >= t->write_len && crc_at + crc_size <= t->write_len + t->read_len;
+}
+
+/**
+ * Generic transaction for any 1-Wire device: optional reset, write, read and
+ * an optional CRC check, repeated on a CRC error like the other commands
+ * Only a transaction starting with a reset is repeated, without one the
+ * device is in the middle of a command and would take the write as data.
+ * A failed reset aborts the transaction
+ * returns ONEWIRE_STATUS_*
+ */
+static u8
+generic_transaction (struct onewire_dev *dev, struct onewire_ioc_transaction *t)
+{
+    ktime_t start = ktime_get ();
+    bool crc_correct = true;
+    bool may_retry
+        = (t->flags & ONEWIRE_TRANSACTION_RESET) && !(t->flags & ONEWIRE_TRANSACTION_NO_RETRY);
+
+    for (unsigned int retry = 0;; retry++)
+    {
+        if (t->flags & ONEWIRE_TRANSACTION_RESET)
+        {
+            u8 status = reset (dev);
+            if (status != ONEWIRE_STATUS_OK)
+            {
+                return status;
+            }
+        }
+        if (t->write_len)
+        {
+            write_cmd (dev, (char *)t->write_data, t->write_len);
+        }
+        if (t->read_len)
+        {
+            read_bytes (dev, (char *)t->read_data, t->read_len);
+        }
+
+        if (t->crc == ONEWIRE_CRC_NONE)
+        {
+            return ONEWIRE_STATUS_OK;
         }
-        else if (s_dev->kernel_buffer[0] == 'l')
+
+        crc_correct = transaction_crc_ok (dev, t);
+        if (crc_correct || !may_retry || !retry_after_crc_error (dev, retry, start))
+            break;
+    }
+
+    if (!crc_correct)
+    {
+        dev->stat_crc_failures++;
+        return ONEWIRE_STATUS_CRC_ERROR;
+    }
+    return ONEWIRE_STATUS_OK;
+}
+
+/**
+ * Convert T on all devices, then read every cached device with match ROM
+ * Answers with a 'B' record (device count, conversion time in ms) followed by
+ * one record per device: index, CRC ok, temperature LSB, MSB, TH, TL, config
+ * and the scratchpad CRC
+ */
+static void
+batch_read (struct onewire_dev *dev)
+{
+    if (dev->rom_count == 0 && search_rom (dev) < 0)
+    {
+        dev->rom_count = 0;
+    }
+
+    unsigned int elapsed_us;
+    u8 status = convert (dev, NULL, &elapsed_us);
+    unsigned int conversion_ms = DIV_ROUND_UP (elapsed_us, 1000);
+
+    // an empty or shorted bus reports no devices
+    u8 count = status == ONEWIRE_STATUS_NO_DEVICE || status == ONEWIRE_STATUS_BUS_SHORT
+                   ? 0
+                   : dev->rom_count;
+    char header[8] = { 'B', count, conversion_ms & 0xFF, (conversion_ms >> 8) & 0xFF };
+    write_response (dev, header, sizeof (header), status);
+
+    for (int i = 0; i < count; i++)
+    {
+        char data_read[9] = { 0 };
+        status = read_scratchpad (dev, dev->rom_ids[i], data_read);
+
+        char record[8] = { i, status == ONEWIRE_STATUS_OK };
+        memcpy (record + 2, data_read, 5);
+        record[7] = data_read[8];
+        write_response (dev, record, sizeof (record), status);
+    }
+}
+
+/**
+ * Adds the cached ROM IDs to the FIFO
+ * a '#' record with the number of IDs followed by one record per ID
+ */
+static void
+write_response_roms (struct onewire_dev *dev)
+{
+    char header[8] = { '#', dev->rom_count };
+    write_response (dev, header, sizeof (header), ONEWIRE_STATUS_OK);
+
+    for (int i = 0; i < dev->rom_count; i++)
+    {
+        write_response (dev, dev->rom_ids[i], ROM_SIZE, ONEWIRE_STATUS_OK);
+    }
+}
+
+/**
+ * Frees a bus once the platform device, all files and all mappings are gone
+ */
+static void
+onewire_free (struct kref *ref)
+{
+    struct onewire_dev *dev = container_of (ref, struct onewire_dev, ref);
+    int minor = dev->minor;
+
+    // runs the commands still queued, they see dev->removed and skip the bus
+    destroy_workqueue (dev->cmd_queue);
+
+    vfree (dev->ring);
+    kfree (dev->kernel_buffer);
+    kfree (dev);
+
+    // the minor is reused only when nothing of the old bus is left
+    mutex_lock (&onewire_idr_lock);
+    idr_remove (&onewire_idr, minor);
+    mutex_unlock (&onewire_idr_lock);
+}
+
+/**
+ * Handles the device open operation
+ * locks the driver from accesses to other processes
+ */
+static int
+onewire_open (struct inode *inode, struct file *filp)
+{
+    mutex_lock (&onewire_idr_lock);
+    struct onewire_dev *dev = idr_find (&onewire_idr, iminor (inode));
+    if (dev)
+    {
+        kref_get (&dev->ref);
+    }
+    mutex_unlock (&onewire_idr_lock);
+
+    if (!dev)
+    {
+        return -ENODEV;
+    }
+
+    printk (KERN_INFO "%s%d: Device opened\n", MODULE_NAME, dev->minor);
+
+    // check if the device is already opened
+    if (mutex_lock_interruptible (&dev->open_mutex))
+    {
+        kref_put (&dev->ref, onewire_free);
+        return -ERESTARTSYS;
+    }
+
+    if (dev->device_opened)
+    {
+        mutex_unlock (&dev->open_mutex);
+        kref_put (&dev->ref, onewire_free);
+        return -EBUSY;
+    }
+
+    // grab the device
+    dev->device_opened = true;
+    mutex_unlock (&dev->open_mutex);
+
+    filp->private_data = dev;
+
+    return 0;
+}
+
+/**
+ * Handles the device release operation
+ * frees the driver lock
+ */
+static int
+onewire_release (struct inode *inode, struct file *filp)
+{
+    struct onewire_dev *dev = filp->private_data;
+
+    printk (KERN_INFO "%s%d: Device released\n", MODULE_NAME, dev->minor);
+
+    // release the device
+    mutex_lock (&dev->open_mutex);
+    dev->device_opened = false;
+    mutex_unlock (&dev->open_mutex);
+
+    kref_put (&dev->ref, onewire_free);
+    return 0;
+}
+
+/**
+ * Takes the next result for read () and ONEWIRE_IOC_READ_RESULT
+ * Sleeps until a result is queued, or returns -EAGAIN with O_NONBLOCK
+ * While the ring is mapped new results only go there, once the FIFO is
+ * empty -EBUSY is returned instead of sleeping
+ * returns 0, -EBUSY or -ENODEV once the bus is removed and no result is left
+ */
+static int
+next_result (struct onewire_dev *dev, struct file *filp, struct read_data_t *result)
+{
+    while (!take_result (dev, result))
+    {
+        if (READ_ONCE (dev->removed))
+        {
+            return -ENODEV;
+        }
+        if (ring_mapped (dev))
+        {
+            return -EBUSY;
+        }
+        if (filp->f_flags & O_NONBLOCK)
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible (dev->result_wait, !kfifo_is_empty (&dev->result_fifo)
+                                                            || ring_mapped (dev)
+                                                            || READ_ONCE (dev->removed)))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+    if (trace_onewire_fifo_enabled ())
+    {
+        trace_onewire_fifo (results_pending (dev));
+    }
+    return 0;
+}
+
+/**
+ * Reads an element from the KFIFO and returns its content to the user space
+ * Sleeps until a result is queued, or returns -EAGAIN with O_NONBLOCK
+ */
+static ssize_t
+onewire_read (struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct onewire_dev *dev = filp->private_data;
+
+    // read the fifo data
+    struct read_data_t result;
+    int err = next_result (dev, filp, &result);
+    if (err)
+    {
+        return err;
+    }
+
+    // only the data is returned, result.size is at most 8
+    // boundary checks
+    size_t min_count = min (count, (size_t)result.size);
+    if (count < result.size)
+    {
+        pr_warn ("%s: userspace buffer is too small (%zu < %zu)\n", MODULE_NAME, count, min_count);
+    }
+
+    if (copy_to_user (buf, result.data, min_count))
+    {
+        return -EFAULT; // Failed to copy to user space
+    }
+
+    *f_pos += min_count;
+    return min_count;
+}
+
+/**
+ * Commands of the write() interface and their minimum length
+ */
+static const struct
+{
+    const char *name;
+    size_t min_size;
+} commands[] = {
+    { "r", 1 },    { "h", 1 },    { "l", 1 },     { "i", 1 },    { "0", 1 },  { "1", 1 },
+    { "ECRC", 4 }, { "DCRC", 4 }, { "FLUSH", 5 }, { "SIZE", 4 }, { "RA", 2 }, { "WS", 5 },
+    { "RS", 2 },   { "SR", 2 },   { "LR", 2 },    { "BT", 2 },   { "CT", 2 },
+};
+
+/**
+ * returns true if data starts with a known command and is long enough for it
+ */
+static bool
+command_valid (const char *data, size_t size)
+{
+    for (size_t i = 0; i < ARRAY_SIZE (commands); i++)
+    {
+        size_t length = strlen (commands[i].name);
+        if (size >= commands[i].min_size && string_cmp (data, commands[i].name, length))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Runs one queued command on the bus
+ * It interprets the characters and runs the according operation
+ * not all operations are 1-Wire related
+ */
+static void
+run_command (struct onewire_dev *dev, const struct onewire_cmd *cmd)
+{
+    const char *text = cmd->data;
+    size_t count = cmd->size;
+    enum onewire_op op = ONEWIRE_OP_OTHER;
+
+    transaction_begin (dev);
+
+    if (count > 0)
+    {
+        if (text[0] == 'r')
+        {
+            op = ONEWIRE_OP_RESET;
+            char data[8] = { 'r' };
+            write_response (dev, data, sizeof (data), reset (dev));
+        }
+        else if (text[0] == 'h')
+        {
+            gpiod_direction_output (dev->pin, 1);
+            gpiod_set_value (dev->pin, 1);
+            write_response_char (dev, 'h');
+        }
+        else if (text[0] == 'l')
+        {
+            gpiod_direction_output (dev->pin, 0);
+            gpiod_set_value (dev->pin, 0);
+            write_response_char (dev, 'l');
+        }
+        else if (text[0] == 'i')
+        {
+            gpiod_direction_input (dev->pin);
+            write_response_char (dev, 'i');
+        }
+        else if (string_cmp (text, "ECRC", 4))
+        {
+            dev->resend_false_crc = true;
+            write_response_char (dev, '1');
+        }
+        else if (string_cmp (text, "DCRC", 4))
+        {
+            dev->resend_false_crc = false;
+            write_response_char (dev, '1');
+        }
+        else if (string_cmp (text, "FLUSH", 5)) // Flush the FIFO
+        {
+            unsigned long flags;
+
+            // the records are inline, nothing to free, only the consumer index moves
+            spin_lock_irqsave (&dev->result_lock, flags);
+            kfifo_reset_out (&dev->result_fifo);
+            spin_unlock_irqrestore (&dev->result_lock, flags);
+            // tail of the ring is only written by its consumer, it skips old records by seq
+        }
+        else if (string_cmp (text, "SIZE", 4)) // Get FIFO size
+        {
+            unsigned int pending = results_pending (dev);
+
+            // little endian
+            char data[8] = { pending & 0xFF, (pending >> 8) & 0xFF, (pending >> 16) & 0xFF,
+                             (pending >> 24) & 0xFF };
+            write_response (dev, data, sizeof (data), ONEWIRE_STATUS_OK);
+        }
+        else if (string_cmp (text, "RA", 2)) // Read Address
+        {
+            op = ONEWIRE_OP_READ_ROM;
+            char data_read[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+            u8 status = read_rom (dev, data_read);
+
+            write_response (dev, data_read, sizeof (data_read), status);
+        }
+        /**
+         * Write scratchpad gets 3 addtional bytes: TH, TL and config
+         */
+        else if (string_cmp (text, "WS", 2)) // Write Scrathpad
+        {
+            op = ONEWIRE_OP_WRITE_SCRATCHPAD;
+            if (count >= 5)
+            {
+                u8 config = text[4];
+                if (write_scratchpad (dev, NULL, text[2], text[3], config) == ONEWIRE_STATUS_OK)
+                {
+                    note_resolution (dev, NULL, config_resolution (config));
+                }
+            }
+        }
+        else if (string_cmp (text, "RS", 2)) // Read Scrathpad
+        {
+            op = ONEWIRE_OP_READ_SCRATCHPAD;
+            char data_read[9] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0, 0x0 };
+            u8 status = read_scratchpad (dev, NULL, data_read);
+
+            write_response (dev, data_read, 8, status);
+        }
+        else if (string_cmp (text, "SR", 2)) // Search ROM
+        {
+            op = ONEWIRE_OP_SEARCH_ROM;
+            int ret = search_rom (dev);
+            if (ret < 0)
+            {
+                dev->rom_count = 0;
+            }
+            write_response_roms (dev);
+        }
+        else if (string_cmp (text, "LR", 2)) // List cached ROM IDs
+        {
+            write_response_roms (dev);
+        }
+        else if (string_cmp (text, "BT", 2)) // Batch convert and read all
+        {
+            op = ONEWIRE_OP_BATCH_READ;
+            batch_read (dev);
+        }
+        else if (string_cmp (text, "CT", 2)) // convert temperature
+        {
+            op = ONEWIRE_OP_CONVERT;
+            unsigned int elapsed_us;
+            u8 status = convert (dev, NULL, &elapsed_us);
+            unsigned int conversion_ms = DIV_ROUND_UP (elapsed_us, 1000);
+
+            // signal the client the conversion has finished, followed by its time in ms
+            char data[3] = { '-', conversion_ms & 0xFF, (conversion_ms >> 8) & 0xFF };
+            write_response (dev, data, sizeof (data), status);
+        }
+        else // Set the value for the PIN
+        {
+            if (text[0] == '0' || text[0] == '1')
+            {
+                int value = text[0] - '0';
+                gpiod_direction_output (dev->pin, value);
+            }
+        }
+    }
+
+    transaction_end (dev, op);
+    // results_pending reads the ring header, skip it while nobody traces
+    if (trace_onewire_fifo_enabled ())
+    {
+        trace_onewire_fifo (results_pending (dev));
+    }
+}
+
+/**
+ * Bus worker, runs the queued commands in order
+ * Only one instance runs at a time on the ordered workqueue, so it is the
+ * only reader of cmd_fifo
+ */
+static void
+command_work (struct work_struct *work)
+{
+    struct onewire_dev *dev = container_of (work, struct onewire_dev, cmd_work);
+    struct onewire_cmd cmd;
+
+    while (kfifo_get (&dev->cmd_fifo, &cmd))
+    {
+        wake_up_interruptible (&dev->cmd_space);
+
+        mutex_lock (&dev->bus_mutex);
+        if (!dev->removed)
+        {
+            dev->seq_running = cmd.seq;
+            run_command (dev, &cmd);
+            dev->seq_running = 0;
+        }
+        mutex_unlock (&dev->bus_mutex);
+
+        WRITE_ONCE (dev->seq_completed, cmd.seq);
+        wake_up_interruptible_all (&dev->seq_wait);
+    }
+}
+
+/**
+ * returns true once the command with sequence number seq has finished
+ */
+static bool
+seq_done (struct onewire_dev *dev, u32 seq)
+{
+    return (s32)(READ_ONCE (dev->seq_completed) - seq) >= 0;
+}
+
+/**
+ * Length of the command at the start of data, without its delimiter
+ * WS carries 3 binary bytes that may contain the delimiter, it is always 5
+ * bytes long
+ */
+static size_t
+command_length (const char *data, size_t size)
+{
+    if (size >= 5 && string_cmp (data, "WS", 2))
+    {
+        return 5;
+    }
+
+    const char *end = memchr (data, CMD_DELIMITER, size);
+    return end ? end - data : size;
+}
+
+/**
+ * returns true for an empty command, like the newline after the last delimiter
+ */
+static bool
+command_empty (const char *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (!isspace (data[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Adds a command to the queue of the bus worker and assigns its sequence number
+ * Waits for a free command slot, or returns -EAGAIN if nonblock is set
+ */
+static int
+queue_command (struct onewire_dev *dev, struct onewire_cmd *cmd, bool nonblock)
+{
+    while (true)
+    {
+        unsigned long flags;
+
+        spin_lock_irqsave (&dev->cmd_lock, flags);
+        if (!kfifo_is_full (&dev->cmd_fifo))
+        {
+            // 0 is never used, it marks results of ioctls
+            if (++dev->seq_submitted == 0)
+            {
+                dev->seq_submitted = 1;
+            }
+            cmd->seq = dev->seq_submitted;
+            kfifo_put (&dev->cmd_fifo, *cmd);
+            spin_unlock_irqrestore (&dev->cmd_lock, flags);
+            break;
+        }
+        spin_unlock_irqrestore (&dev->cmd_lock, flags);
+
+        if (nonblock)
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible (dev->cmd_space, !kfifo_is_full (&dev->cmd_fifo)))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    queue_work (dev->cmd_queue, &dev->cmd_work);
+    return 0;
+}
+
+/**
+ * Handles the write operation from user space
+ * One write may hold several commands separated by CMD_DELIMITER, e.g.
+ * "FLUSH;CT;RS". Every command is validated and queued for the bus worker,
+ * write() returns before the bus is touched. Commands get consecutive
+ * sequence numbers, the results of a command carry its number.
+ * A bad command rejects the whole write with -EINVAL. If the command queue
+ * runs full with O_NONBLOCK, or a signal arrives, the bytes of the commands
+ * queued so far are returned. The file position is not used.
+ */
+static ssize_t
+onewire_write (struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct onewire_dev *dev = filp->private_data;
+    const char *text = dev->kernel_buffer;
+    size_t pos;
+    ssize_t ret = count;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+    if (count > dev->buffer_size)
+    {
+        return -EINVAL;
+    }
+
+    if (READ_ONCE (dev->removed))
+    {
+        return -ENODEV;
+    }
+
+    if (mutex_lock_interruptible (&dev->write_mutex))
+    {
+        return -ERESTARTSYS;
+    }
+
+    if (copy_from_user (dev->kernel_buffer, buf, count))
+    {
+        mutex_unlock (&dev->write_mutex);
+        return -EFAULT; // Failed to copy from user space
+    }
+
+    trace_onewire_command (dev->kernel_buffer, count);
+
+    // validate everything before the first command is queued
+    for (pos = 0; pos < count;)
+    {
+        size_t length = command_length (text + pos, count - pos);
+        bool delimited = pos + length == count || text[pos + length] == CMD_DELIMITER;
+
+        if (!delimited
+            || (!command_empty (text + pos, length)
+                && (length > CMD_SIZE || !command_valid (text + pos, length))))
         {
-            gpiod_direction_output (onewire_pin, 0);
-            gpiod_set_value (onewire_pin, 0);
-            write_response_char('l');
+            mutex_unlock (&dev->write_mutex);
+            return -EINVAL;
         }
-        else if (s_dev->kernel_buffer[0] == 'i')
+        pos += length + 1;
+    }
+
+    // results go to the ring while it is mapped, the FIFO does not fill up then
+    if (!ring_mapped (dev) && kfifo_is_full (&dev->result_fifo))
+    {
+        mutex_unlock (&dev->write_mutex);
+        return -EAGAIN; // read the pending results first
+    }
+
+    // the write mutex keeps the commands of one write together in the queue
+    for (pos = 0; pos < count;)
+    {
+        size_t length = command_length (text + pos, count - pos);
+
+        if (!command_empty (text + pos, length))
         {
-            gpiod_direction_input (onewire_pin);
-            write_response_char('i');
+            struct onewire_cmd cmd = { 0 };
+            memcpy (cmd.data, text + pos, length);
+            cmd.size = length;
+
+            int err = queue_command (dev, &cmd, filp->f_flags & O_NONBLOCK);
+            if (err)
+            {
+                ret = pos > 0 ? pos : err;
+                break;
+            }
         }
-        else if (string_cmp (s_dev->kernel_buffer, "ECRC", 4))
+        pos = min (pos + length + 1, count);
+    }
+
+    mutex_unlock (&dev->write_mutex);
+    return ret;
+}
+
+/**
+ * Runs one transaction of the ioctl interface in constants.h
+ * The argument struct is copied in before and out after the bus access
+ */
+static long
+onewire_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct onewire_dev *dev = filp->private_data;
+    void __user *argp = (void __user *)arg;
+    long ret = 0;
+
+    if (_IOC_TYPE (cmd) != ONEWIRE_IOC_MAGIC)
+    {
+        return -ENOTTY;
+    }
+
+    // the queue of the write() interface, no bus access
+    switch (cmd)
+    {
+    case ONEWIRE_IOC_READ_RESULT:
+    {
+        struct onewire_ioc_result r = { 0 };
+        struct read_data_t result;
+
+        int err = next_result (dev, filp, &result);
+        if (err)
         {
-            printk ("Enable CRC check \n");
-            resend_false_crc = true;
-            write_response_char('1');
+            return err;
         }
-        else if (string_cmp (s_dev->kernel_buffer, "DCRC", 4))
+
+        r.seq = result.seq;
+        r.status = result.status;
+        r.size = result.size;
+        r.timestamp_ns = result.timestamp_ns;
+        memcpy (r.data, result.data, sizeof (r.data));
+
+        return copy_to_user (argp, &r, sizeof (r)) ? -EFAULT : 0;
+    }
+    case ONEWIRE_IOC_WAIT_SEQUENCE:
+    {
+        struct onewire_ioc_sequence r;
+        if (copy_from_user (&r, argp, sizeof (r)))
         {
-            printk ("Disable CRC check \n");
-            resend_false_crc = false;
-            write_response_char('1');
+            return -EFAULT;
         }
-        else if (string_cmp (s_dev->kernel_buffer, "FLUSH", 5)) // Flush the FIFO
+
+        u32 seq = r.seq ? r.seq : READ_ONCE (dev->seq_submitted);
+        if (r.timeout_ms
+            && wait_event_interruptible_timeout (dev->seq_wait, seq_done (dev, seq),
+                                                 msecs_to_jiffies (r.timeout_ms))
+                   < 0)
         {
-            printk ("FLUSH \n");
-            printk ("KFIFO length %u \n", kfifo_len (&result_fifo));
-            unsigned int kfifo_len = kfifo_len (&result_fifo);
+            return -ERESTARTSYS;
+        }
 
-            // free all memory of the pointer elements
-            struct read_data_t *result = NULL;
-            for (unsigned int off = 0; off < kfifo_len; ++off)
-            {
-                if (kfifo_get (&result_fifo, &result) > 0)
-                {
-                    kfree (result);
-                }
-                else
-                {
-                    pr_err ("Error in 'FLUSH' can not free at iteration index %u ", off);
-                }
-            }
+        r.submitted = READ_ONCE (dev->seq_submitted);
+        r.completed = READ_ONCE (dev->seq_completed);
 
-            printk ("KFIFO length %u \n", kfifo_len (&result_fifo));
-        }
-        else if (string_cmp (s_dev->kernel_buffer, "SIZE", 4)) // Get FIFO size
-        {
-            unsigned int kfifo_len = kfifo_len (&result_fifo);
-            printk ("KFIFO length %u \n", kfifo_len (&result_fifo));
+        return copy_to_user (argp, &r, sizeof (r)) ? -EFAULT : 0;
+    }
+    }
 
-            // read all fifo items and free its allocated memory
-            struct read_data_t *result = kmalloc (sizeof (struct read_data_t), GFP_KERNEL);
-            for (int i = 0; i < 8; i++)
-            {
-                result->data[i] = 0;
-            }
-            result->size = 8;
-            result->data[0] = kfifo_len & 0xFF;
-            result->data[1] = kfifo_len & 0xFF00;
-            result->data[2] = kfifo_len & 0xFF0000;
-            result->data[3] = kfifo_len & 0xFF000000;
+    // commands written before the ioctl run first
+    flush_workqueue (dev->cmd_queue);
 
-            kfifo_put (&result_fifo, result);
-        }
-        else if (string_cmp (s_dev->kernel_buffer, "RA", 2)) // Read Address
-        {
-            printk ("Read Address \n");
-            reset (onewire_pin);
+    if (mutex_lock_interruptible (&dev->bus_mutex))
+    {
+        return -ERESTARTSYS;
+    }
+    if (dev->removed)
+    {
+        mutex_unlock (&dev->bus_mutex);
+        return -ENODEV;
+    }
+    transaction_begin (dev);
 
-            // char data[2] = { 0xCC, 0xBE };
-            char data[1] = { 0x33 };
-            write_cmd (onewire_pin, data, 1);
+    switch (cmd)
+    {
+    case ONEWIRE_IOC_RESET:
+    {
+        struct onewire_ioc_reset r = { 0 };
+        ktime_t start = ktime_get ();
 
-            udelay (500);
-            char data_read[8] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+        r.status = reset (dev);
+        r.duration_us = ktime_us_delta (ktime_get (), start);
+        transaction_end (dev, ONEWIRE_OP_RESET);
 
-            if (resend_false_crc)
-            {
-                int crc_correct = 0;
-                for (int i = 0; i < 20; i++)
-                {
-                    crc_correct = read_cmd (onewire_pin, data_read, 8);
-                    if (crc_correct)
-                        break;
-                    else
-                        msleep (1000);
-                }
-            }
-            else
-            {
-                read_cmd (onewire_pin, data_read, 8);
-            }
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_READ_ROM:
+    {
+        struct onewire_ioc_rom r = { 0 };
 
-            struct read_data_t *result = kmalloc (sizeof (struct read_data_t), GFP_KERNEL);
-            for (int i = 0; i < 8; i++)
-            {
-                result->data[i] = data_read[i];
-            }
-            result->size = 8;
+        r.status = read_rom (dev, r.rom);
+        transaction_end (dev, ONEWIRE_OP_READ_ROM);
 
-            printk ("prt adr %p &adr %p \n", result, &result);
-            kfifo_put (&result_fifo, result);
-        }
-        /**
-         * Write scratchpad gets 3 addtional bytes
-         */
-        else if (string_cmp (s_dev->kernel_buffer, "WS", 2)) // Write Scrathpad
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_READ_SCRATCHPAD:
+    {
+        struct onewire_ioc_scratchpad r;
+        if (copy_from_user (&r, argp, sizeof (r)))
         {
-            reset (onewire_pin);
+            ret = -EFAULT;
+            break;
+        }
 
-            char data[7];
-            data[0] = 0xCC;
-            data[1] = 0x4E;
-            for (int i = 0; i < min (3, count - 2); i++)
-            {
-                data[i + 2] = s_dev->kernel_buffer[i + 2];
-            }
-            write_cmd (onewire_pin, data, sizeof (data));
+        r.status = read_scratchpad (dev, r.target.use_rom ? r.target.rom : NULL, r.data);
+        transaction_end (dev, ONEWIRE_OP_READ_SCRATCHPAD);
 
-            udelay (600);
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_WRITE_SCRATCHPAD:
+    {
+        struct onewire_ioc_write_scratchpad r;
+        if (copy_from_user (&r, argp, sizeof (r)))
+        {
+            ret = -EFAULT;
+            break;
         }
-        else if (string_cmp (s_dev->kernel_buffer, "RS", 2)) // Read Scrathpad
+
+        r.status = write_scratchpad (dev, r.target.use_rom ? r.target.rom : NULL, r.th, r.tl,
+                                     r.config);
+        transaction_end (dev, ONEWIRE_OP_WRITE_SCRATCHPAD);
+
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_CONVERT:
+    {
+        struct onewire_ioc_convert r;
+        if (copy_from_user (&r, argp, sizeof (r)))
         {
-            printk ("Read scratchpad \n");
-            reset (onewire_pin);
+            ret = -EFAULT;
+            break;
+        }
 
-            char data[2];
-            data[0] = 0xCC;
-            data[1] = 0xBE;
-            write_cmd (onewire_pin, data, 2);
+        r.status = convert (dev, r.target.use_rom ? r.target.rom : NULL, &r.conversion_us);
+        transaction_end (dev, ONEWIRE_OP_CONVERT);
 
-            udelay (600);
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_SET_RESOLUTION:
+    {
+        struct onewire_ioc_resolution r;
+        if (copy_from_user (&r, argp, sizeof (r)))
+        {
+            ret = -EFAULT;
+            break;
+        }
+        if (r.bits < ONEWIRE_RESOLUTION_MIN || r.bits > ONEWIRE_RESOLUTION_MAX)
+        {
+            ret = -EINVAL;
+            break;
+        }
 
-            char data_read[9] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0, 0x0 };
-            int crc_correct = 0;
-            if (resend_false_crc)
-            {
-                for (int i = 0; i < 20; i++)
-                {
-                    crc_correct = read_cmd (onewire_pin, data_read, 8 + 1);
-                    printk ("computed crc %d \n", crc_correct);
-                    if (crc_correct)
-                        break;
-                    else
-                        msleep (1000);
-                }
-            }
-            else
-            {
-                crc_correct = read_cmd (onewire_pin, data_read, 8 + 1);
-                printk ("computed crc %d \n", crc_correct);
-            }
+        const uint8_t *rom = r.target.use_rom ? r.target.rom : NULL;
+        r.status = set_resolution (dev, rom, r.bits, r.persist);
+        r.conversion_ms = conversion_time_ms (resolution_of (dev, rom));
+        transaction_end (dev, ONEWIRE_OP_RESOLUTION);
 
-            struct read_data_t *result = kmalloc (sizeof (struct read_data_t), GFP_KERNEL);
-            for (int i = 0; i < 8; i++)
-            {
-                result->data[i] = data_read[i];
-            }
-            result->size = 8;
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_GET_RESOLUTION:
+    {
+        struct onewire_ioc_resolution r;
+        if (copy_from_user (&r, argp, sizeof (r)))
+        {
+            ret = -EFAULT;
+            break;
+        }
 
-            kfifo_put (&result_fifo, result);
+        const uint8_t *rom = r.target.use_rom ? r.target.rom : NULL;
+        r.status = get_resolution (dev, rom, &r.bits);
+        r.conversion_ms = conversion_time_ms (resolution_of (dev, rom));
+        transaction_end (dev, ONEWIRE_OP_RESOLUTION);
+
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_TRANSACTION:
+    {
+        struct onewire_ioc_transaction *t = kmalloc (sizeof (*t), GFP_KERNEL);
+        if (!t)
+        {
+            ret = -ENOMEM;
+            break;
         }
-        else if (string_cmp (s_dev->kernel_buffer, "CT", 2)) // convert temperature
+        if (copy_from_user (t, argp, sizeof (*t)))
         {
-            reset (onewire_pin);
+            kfree (t);
+            ret = -EFAULT;
+            break;
+        }
+        if (!transaction_valid (t))
+        {
+            kfree (t);
+            ret = -EINVAL;
+            break;
+        }
 
-            char data[2];
-            data[0] = 0xCC;
-            data[1] = 0x44;
-            write_cmd (onewire_pin, data, 2);
+        t->status = generic_transaction (dev, t);
+        transaction_end (dev, ONEWIRE_OP_TRANSACTION);
 
-            // give data to the client so signal command has finished
-            struct read_data_t *result = kmalloc (sizeof (struct read_data_t), GFP_KERNEL);
-            result->size = 1;
-            result->data[0] = '-';
-            kfifo_put (&result_fifo, result);
+        if (copy_to_user (argp, t, sizeof (*t)))
+            ret = -EFAULT;
+        kfree (t);
+        break;
+    }
+    case ONEWIRE_IOC_GET_CONFIG:
+    {
+        struct onewire_ioc_config r = { 0 };
+        r.flags = dev->resend_false_crc ? ONEWIRE_CONFIG_CRC_RETRY : 0;
+        r.retry_max = dev->retry_policy.max_retries;
+        r.retry_first_ms = dev->retry_policy.first_ms;
+        r.retry_max_delay_ms = dev->retry_policy.max_delay_ms;
+        r.retry_deadline_ms = dev->retry_policy.deadline_ms;
+
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    case ONEWIRE_IOC_SET_CONFIG:
+    {
+        struct onewire_ioc_config r;
+        if (copy_from_user (&r, argp, sizeof (r)))
+        {
+            ret = -EFAULT;
+            break;
         }
-        else // Set the value for the PIN
+        if (r.flags & ~ONEWIRE_CONFIG_CRC_RETRY)
         {
-            if (s_dev->kernel_buffer[0] == '0' || s_dev->kernel_buffer[0] == '1')
-            {
-                int value = s_dev->kernel_buffer[0] - '0';
-                pr_info ("value %i\n", value);
-                gpiod_direction_output (onewire_pin, value);
-            }
+            ret = -EINVAL;
+            break;
+        }
+
+        if (r.retry_first_ms == 0 || r.retry_max_delay_ms < r.retry_first_ms)
+        {
+            ret = -EINVAL;
+            break;
         }
+
+        dev->resend_false_crc = r.flags & ONEWIRE_CONFIG_CRC_RETRY;
+        dev->retry_policy.max_retries = r.retry_max;
+        dev->retry_policy.first_ms = r.retry_first_ms;
+        dev->retry_policy.max_delay_ms = r.retry_max_delay_ms;
+        dev->retry_policy.deadline_ms = r.retry_deadline_ms;
+        break;
+    }
+    case ONEWIRE_IOC_GET_STATS:
+    {
+        struct onewire_ioc_stats r = { 0 };
+        r.transactions = dev->stat_transactions;
+        r.irq_off_ns = dev->stat_irq_off_ns;
+        r.irq_off_last_ns = dev->stat_irq_off_last_ns;
+        r.irq_off_max_ns = dev->stat_irq_off_max_ns;
+        r.resets = dev->stat_resets;
+        r.crc_errors = dev->stat_crc_errors;
+        r.retries = dev->stat_retries;
+        r.crc_failures = dev->stat_crc_failures;
+        r.no_presence = dev->stat_no_presence;
+        r.bus_shorts = dev->stat_bus_short;
+        r.results_dropped = dev->results_dropped;
+        r.fifo_len = results_pending (dev);
+
+        if (copy_to_user (argp, &r, sizeof (r)))
+            ret = -EFAULT;
+        break;
+    }
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+
+    mutex_unlock (&dev->bus_mutex);
+    return ret;
+}
+
+/**
+ * Readable while the FIFO or the ring holds a result, commands can always be written
+ */
+static __poll_t
+onewire_poll (struct file *filp, poll_table *wait)
+{
+    struct onewire_dev *dev = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait (filp, &dev->result_wait, wait);
+    if (results_pending (dev) > 0)
+    {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (READ_ONCE (dev->removed))
+    {
+        mask |= EPOLLHUP;
+    }
+
+    return mask;
+}
+
+static void
+onewire_vm_open (struct vm_area_struct *vma)
+{
+    struct onewire_dev *dev = vma->vm_private_data;
+    unsigned long flags;
+
+    kref_get (&dev->ref);
+    spin_lock_irqsave (&dev->result_lock, flags);
+    atomic_inc (&dev->ring_maps);
+    spin_unlock_irqrestore (&dev->result_lock, flags);
+
+    // blocking readers return -EBUSY, the results go to the ring from now on
+    wake_up_interruptible (&dev->result_wait);
+}
+
+/**
+ * With the last mapping the ring loses its consumer, the records left in it
+ * are dropped and the results go to the FIFO again
+ */
+static void
+onewire_vm_close (struct vm_area_struct *vma)
+{
+    struct onewire_dev *dev = vma->vm_private_data;
+    unsigned long flags;
+
+    spin_lock_irqsave (&dev->result_lock, flags);
+    if (atomic_dec_and_test (&dev->ring_maps))
+    {
+        // no userspace consumer is left, the driver owns tail until the next mmap
+        smp_store_release (&dev->ring->header.tail, dev->ring_head);
+    }
+    spin_unlock_irqrestore (&dev->result_lock, flags);
+
+    kref_put (&dev->ref, onewire_free);
+}
+
+static const struct vm_operations_struct onewire_vm_ops = {
+    .open = onewire_vm_open,
+    .close = onewire_vm_close,
+};
+
+/**
+ * Maps the result ring, see struct onewire_ring in constants.h
+ * Results produced while a mapping exists go to the ring
+ */
+static int
+onewire_mmap (struct file *filp, struct vm_area_struct *vma)
+{
+    struct onewire_dev *dev = filp->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_ALIGN (ONEWIRE_RING_MAP_SIZE))
+    {
+        return -EINVAL;
     }
 
-    printk (KERN_INFO "%s: Wrote %zu bytes to device (offset: %lld)\n", MODULE_NAME, count, *f_pos);
-    return bytes_written;
+    int ret = remap_vmalloc_range (vma, dev->ring, 0);
+    if (ret)
+    {
+        return ret;
+    }
+
+    vma->vm_private_data = dev;
+    vma->vm_ops = &onewire_vm_ops;
+    onewire_vm_open (vma);
+    return 0;
 }
 
 // File operations structure
@@ -583,30 +2159,123 @@ static struct file_operations fops = {
     .release = onewire_release,
     .read = onewire_read,
     .write = onewire_write,
+    .poll = onewire_poll,
+    .mmap = onewire_mmap,
+    .unlocked_ioctl = onewire_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
     .owner = THIS_MODULE,
 };
 
 /**
- * Initialize the driver
+ * Bus statistics in /sys/class/onewire_dev/onewire_devN/stats, one value per file
+ * The counters are read without the bus lock, a value may be one transaction old
+ */
+#define ONEWIRE_STAT_ATTR(_name, _field)                                                          \
+    static ssize_t _name##_show (struct device *device, struct device_attribute *attr,           \
+                                 char *buf)                                                       \
+    {                                                                                             \
+        struct onewire_dev *dev = dev_get_drvdata (device);                                       \
+        return sysfs_emit (buf, "%llu\n", (unsigned long long)READ_ONCE (dev->_field));           \
+    }                                                                                             \
+    static DEVICE_ATTR_RO (_name)
+
+ONEWIRE_STAT_ATTR (transactions, stat_transactions);
+ONEWIRE_STAT_ATTR (transactions_reset, stat_ops[ONEWIRE_OP_RESET]);
+ONEWIRE_STAT_ATTR (transactions_read_rom, stat_ops[ONEWIRE_OP_READ_ROM]);
+ONEWIRE_STAT_ATTR (transactions_read_scratchpad, stat_ops[ONEWIRE_OP_READ_SCRATCHPAD]);
+ONEWIRE_STAT_ATTR (transactions_write_scratchpad, stat_ops[ONEWIRE_OP_WRITE_SCRATCHPAD]);
+ONEWIRE_STAT_ATTR (transactions_convert, stat_ops[ONEWIRE_OP_CONVERT]);
+ONEWIRE_STAT_ATTR (transactions_search_rom, stat_ops[ONEWIRE_OP_SEARCH_ROM]);
+ONEWIRE_STAT_ATTR (transactions_batch_read, stat_ops[ONEWIRE_OP_BATCH_READ]);
+ONEWIRE_STAT_ATTR (transactions_resolution, stat_ops[ONEWIRE_OP_RESOLUTION]);
+ONEWIRE_STAT_ATTR (transactions_generic, stat_ops[ONEWIRE_OP_TRANSACTION]);
+ONEWIRE_STAT_ATTR (transactions_other, stat_ops[ONEWIRE_OP_OTHER]);
+ONEWIRE_STAT_ATTR (bytes_written, stat_bytes_written);
+ONEWIRE_STAT_ATTR (bytes_read, stat_bytes_read);
+ONEWIRE_STAT_ATTR (resets, stat_resets);
+ONEWIRE_STAT_ATTR (no_presence, stat_no_presence);
+ONEWIRE_STAT_ATTR (bus_shorts, stat_bus_short);
+ONEWIRE_STAT_ATTR (crc_errors, stat_crc_errors);
+ONEWIRE_STAT_ATTR (crc_failures, stat_crc_failures);
+ONEWIRE_STAT_ATTR (retries, stat_retries);
+ONEWIRE_STAT_ATTR (results_dropped, results_dropped);
+ONEWIRE_STAT_ATTR (fifo_max, stat_fifo_max);
+ONEWIRE_STAT_ATTR (write_cmd_ns, stat_write_cmd.total_ns);
+ONEWIRE_STAT_ATTR (write_cmd_max_ns, stat_write_cmd.max_ns);
+ONEWIRE_STAT_ATTR (read_cmd_ns, stat_read_cmd.total_ns);
+ONEWIRE_STAT_ATTR (read_cmd_max_ns, stat_read_cmd.max_ns);
+ONEWIRE_STAT_ATTR (reset_ns, stat_reset.total_ns);
+ONEWIRE_STAT_ATTR (reset_max_ns, stat_reset.max_ns);
+ONEWIRE_STAT_ATTR (irq_off_ns, stat_irq_off_ns);
+ONEWIRE_STAT_ATTR (irq_off_max_ns, stat_irq_off_max_ns);
+
+static struct attribute *onewire_stats_attrs[] = {
+    &dev_attr_transactions.attr,
+    &dev_attr_transactions_reset.attr,
+    &dev_attr_transactions_read_rom.attr,
+    &dev_attr_transactions_read_scratchpad.attr,
+    &dev_attr_transactions_write_scratchpad.attr,
+    &dev_attr_transactions_convert.attr,
+    &dev_attr_transactions_search_rom.attr,
+    &dev_attr_transactions_batch_read.attr,
+    &dev_attr_transactions_resolution.attr,
+    &dev_attr_transactions_generic.attr,
+    &dev_attr_transactions_other.attr,
+    &dev_attr_bytes_written.attr,
+    &dev_attr_bytes_read.attr,
+    &dev_attr_resets.attr,
+    &dev_attr_no_presence.attr,
+    &dev_attr_bus_shorts.attr,
+    &dev_attr_crc_errors.attr,
+    &dev_attr_crc_failures.attr,
+    &dev_attr_retries.attr,
+    &dev_attr_results_dropped.attr,
+    &dev_attr_fifo_max.attr,
+    &dev_attr_write_cmd_ns.attr,
+    &dev_attr_write_cmd_max_ns.attr,
+    &dev_attr_read_cmd_ns.attr,
+    &dev_attr_read_cmd_max_ns.attr,
+    &dev_attr_reset_ns.attr,
+    &dev_attr_reset_max_ns.attr,
+    &dev_attr_irq_off_ns.attr,
+    &dev_attr_irq_off_max_ns.attr,
+    NULL,
+};
+
+static const struct attribute_group onewire_stats_group = {
+    .name = "stats",
+    .attrs = onewire_stats_attrs,
+};
+
+static const struct attribute_group *onewire_groups[] = {
+    &onewire_stats_group,
+    NULL,
+};
+
+/**
+ * Initialize one bus
+ * Every device tree node gets its own state and /dev/onewire_devN, N is the
+ * lowest free minor
  */
 static int
 onewire_probe (struct platform_device *pdev)
 {
     pr_info ("onewire: onewire_probe");
 
-    struct device *dev = &pdev->dev;
+    struct device *device = &pdev->dev;
+    struct onewire_dev *dev;
     const char *label;
     int ret;
     int err;
 
     // checking if the device haas the property label
-    if (!device_property_present (dev, "label"))
+    if (!device_property_present (device, "label"))
     {
         pr_crit ("Device property 'label' not found!\n");
         return -1;
     }
 
-    err = device_property_read_string (dev, "label", &label);
+    err = device_property_read_string (device, "label", &label);
     if (err)
     {
         pr_crit ("dt_gpio - Error! Could not read 'label'\n");
@@ -615,76 +2284,135 @@ onewire_probe (struct platform_device *pdev)
     pr_info ("dt_gpio - label: %s\n", label);
 
     // checking if the device haas the property onewire-gpios
-    if (!device_property_present (dev, "onewire-gpios"))
+    if (!device_property_present (device, "onewire-gpios"))
     {
         pr_crit ("Device property 'onewire-gpios' not found!\n");
         return -1;
     }
 
-    onewire_pin = gpiod_get (dev, PIN_ONEWIRE, GPIOD_OUT_HIGH);
-    if (IS_ERR (onewire_pin))
+    // initializing the bus state
+    dev = kzalloc (sizeof (struct onewire_dev), GFP_KERNEL);
+    if (!dev)
     {
-        pr_crit ("gpiod_get failed: %ld\n", PTR_ERR (onewire_pin));
-        return PTR_ERR (onewire_pin);
+        printk (KERN_ERR "%s: Failed to allocate device structure\n", MODULE_NAME);
+        return -ENOMEM;
     }
-    gpiod_direction_output (onewire_pin, GPIOD_OUT_HIGH); // the the direction to input
 
-    // initializing the character device
-    s_dev = kmalloc (sizeof (struct onewire_dev), GFP_KERNEL);
-    if (!s_dev)
+    dev->pin = gpiod_get (device, PIN_ONEWIRE, GPIOD_OUT_HIGH);
+    if (IS_ERR (dev->pin))
     {
-        ret = -ENOMEM;
-        printk (KERN_ERR "%s: Failed to allocate device structure\n", MODULE_NAME);
-        goto unregister_region;
+        ret = PTR_ERR (dev->pin);
+        pr_crit ("gpiod_get failed: %d\n", ret);
+        goto free_device_struct;
     }
-    memset (s_dev, 0, sizeof (struct onewire_dev));
+    gpiod_direction_output (dev->pin, GPIOD_OUT_HIGH); // the the direction to input
 
     // Allocate kernel buffer
-    s_dev->buffer_size = BUFFER_SIZE; // Use page size for buffer
-    s_dev->kernel_buffer = kmalloc (s_dev->buffer_size, GFP_KERNEL);
-    if (!s_dev->kernel_buffer)
+    dev->buffer_size = BUFFER_SIZE; // Use page size for buffer
+    dev->kernel_buffer = kzalloc (dev->buffer_size, GFP_KERNEL);
+    if (!dev->kernel_buffer)
     {
         ret = -ENOMEM;
         printk (KERN_ERR "%s: Failed to allocate kernel buffer\n", MODULE_NAME);
-        goto free_device_struct;
+        goto free_pin;
     }
-    memset (s_dev->kernel_buffer, 0, s_dev->buffer_size * sizeof (char));
 
-    // initializing character device
-    major_number = register_chrdev (0, MODULE_NAME, &fops);
-    if (major_number < 0)
+    dev->ring = vmalloc_user (ONEWIRE_RING_MAP_SIZE);
+    if (!dev->ring)
     {
-        pr_alert ("Registering char device failed with %d\n", major_number);
+        ret = -ENOMEM;
         goto free_kernel_buffer;
     }
+    dev->ring->header.records = ONEWIRE_RING_RECORDS;
+    dev->ring->header.record_size = sizeof (struct onewire_ioc_result);
 
-    // create the class
-    cls = class_create (MODULE_NAME);
-    if (IS_ERR (cls))
+    // initialize data structures
+    INIT_KFIFO (dev->result_fifo);
+    spin_lock_init (&dev->result_lock);
+    init_waitqueue_head (&dev->result_wait);
+    INIT_KFIFO (dev->cmd_fifo);
+    INIT_WORK (&dev->cmd_work, command_work);
+    spin_lock_init (&dev->cmd_lock);
+    init_waitqueue_head (&dev->cmd_space);
+    init_waitqueue_head (&dev->seq_wait);
+    mutex_init (&dev->open_mutex);
+    mutex_init (&dev->bus_mutex);
+    mutex_init (&dev->write_mutex);
+    kref_init (&dev->ref);
+    dev->device_opened = false;
+    dev->retry_policy = default_retry_policy;
+    dev->bus_resolution = ONEWIRE_RESOLUTION_MAX;
+
+    mutex_lock (&onewire_idr_lock);
+    dev->minor = idr_alloc (&onewire_idr, NULL, 0, ONEWIRE_MAX_BUSES, GFP_KERNEL);
+    mutex_unlock (&onewire_idr_lock);
+    if (dev->minor < 0)
     {
-        ret = -EINVAL;
-        goto unregister_char;
+        ret = dev->minor;
+        pr_alert ("No free minor for another bus: %d\n", ret);
+        goto free_ring;
+    }
+
+    // the bus worker of this bus
+    dev->cmd_queue = alloc_ordered_workqueue ("%s%d", 0, MODULE_NAME, dev->minor);
+    if (!dev->cmd_queue)
+    {
+        ret = -ENOMEM;
+        goto free_minor;
     }
 
-    device_create (cls, NULL, MKDEV (major_number, 0), NULL, MODULE_NAME);
+    // initializing character device
+    // allocated separately, open files keep it until their last fput
+    dev->devt = MKDEV (MAJOR (onewire_devt), dev->minor);
+    dev->cdev = cdev_alloc ();
+    if (!dev->cdev)
+    {
+        ret = -ENOMEM;
+        goto destroy_queue;
+    }
+    dev->cdev->ops = &fops;
+    dev->cdev->owner = THIS_MODULE;
+    ret = cdev_add (dev->cdev, dev->devt, 1);
+    if (ret)
+    {
+        pr_alert ("Registering char device failed with %d\n", ret);
+        kobject_put (&dev->cdev->kobj);
+        goto destroy_queue;
+    }
 
-    pr_info ("Device created on /dev/%s\n", MODULE_NAME);
+    if (IS_ERR (device_create_with_groups (cls, device, dev->devt, dev, onewire_groups,
+                                           MODULE_NAME "%d", dev->minor)))
+    {
+        ret = -EINVAL;
+        goto delete_cdev;
+    }
 
-    // initialize data structures
-    INIT_KFIFO (result_fifo);
+    platform_set_drvdata (pdev, dev);
 
-    device_opened = false;
+    // from now on open () finds the bus
+    mutex_lock (&onewire_idr_lock);
+    idr_replace (&onewire_idr, dev, dev->minor);
+    mutex_unlock (&onewire_idr_lock);
+    pr_info ("Device created on /dev/%s%d\n", MODULE_NAME, dev->minor);
 
     return 0;
 
-unregister_char:
-    unregister_chrdev (major_number, MODULE_NAME);
+delete_cdev:
+    cdev_del (dev->cdev);
+destroy_queue:
+    destroy_workqueue (dev->cmd_queue);
+free_minor:
+    mutex_lock (&onewire_idr_lock);
+    idr_remove (&onewire_idr, dev->minor);
+    mutex_unlock (&onewire_idr_lock);
+free_ring:
+    vfree (dev->ring);
 free_kernel_buffer:
-    kfree (s_dev->kernel_buffer);
+    kfree (dev->kernel_buffer);
+free_pin:
+    gpiod_put (dev->pin); // gree gppio
 free_device_struct:
-    kfree (s_dev);
-unregister_region:
-    gpiod_put (onewire_pin); // gree gppio
+    kfree (dev);
 
     return ret;
 }
@@ -692,21 +2420,30 @@ unregister_region:
 static int
 onewire_remove (struct platform_device *pdev)
 {
-    pr_info ("onewire:  onewire_remove");
+    struct onewire_dev *dev = platform_get_drvdata (pdev);
 
-    kfree (s_dev->kernel_buffer);
+    pr_info ("onewire:  onewire_remove %d", dev->minor);
 
-    // free gpio pin
-    gpiod_put (onewire_pin);
+    // destroy character device, no new open () finds the bus
+    device_destroy (cls, dev->devt);
+    cdev_del (dev->cdev);
+    mutex_lock (&onewire_idr_lock);
+    idr_replace (&onewire_idr, NULL, dev->minor);
+    mutex_unlock (&onewire_idr_lock);
 
-    // destroy character device
-    device_destroy (cls, MKDEV (major_number, 0));
-    class_destroy (cls);
+    // every bus access holds bus_mutex, after this one none touches the pin
+    mutex_lock (&dev->bus_mutex);
+    WRITE_ONCE (dev->removed, true);
+    gpiod_put (dev->pin);
+    dev->pin = NULL;
+    mutex_unlock (&dev->bus_mutex);
+
+    // readers and pollers see the removal
+    wake_up_interruptible_all (&dev->result_wait);
 
-    // unregister
-    unregister_chrdev (major_number, MODULE_NAME);
+    // the rest is freed with the last open file or mapping
+    kref_put (&dev->ref, onewire_free);
 
-    // free gpio pin
     pr_info ("good bye reader!\n");
 
     return 0;
@@ -725,6 +2462,56 @@ struct platform_driver my_driver = {
     .remove = onewire_remove,
 };
 
-module_platform_driver (my_driver);
+/**
+ * Registers the minors and the class shared by all buses, the buses are added
+ * by the platform driver
+ */
+static int __init
+onewire_init (void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region (&onewire_devt, 0, ONEWIRE_MAX_BUSES, MODULE_NAME);
+    if (ret)
+    {
+        pr_alert ("Registering char device region failed with %d\n", ret);
+        return ret;
+    }
+
+    // create the class
+    cls = class_create (MODULE_NAME);
+    if (IS_ERR (cls))
+    {
+        ret = PTR_ERR (cls);
+        goto unregister_region;
+    }
+
+    ret = platform_driver_register (&my_driver);
+    if (ret)
+    {
+        goto destroy_class;
+    }
+
+    return 0;
+
+destroy_class:
+    class_destroy (cls);
+unregister_region:
+    unregister_chrdev_region (onewire_devt, ONEWIRE_MAX_BUSES);
+
+    return ret;
+}
+
+static void __exit
+onewire_exit (void)
+{
+    platform_driver_unregister (&my_driver);
+    idr_destroy (&onewire_idr);
+    class_destroy (cls);
+    unregister_chrdev_region (onewire_devt, ONEWIRE_MAX_BUSES);
+}
+
+module_init (onewire_init);
+module_exit (onewire_exit);
 
 MODULE_LICENSE ("GPL");
@@ -0,0 +1,75 @@
+/**
+ * Tracepoints of the 1-Wire driver
+ * They cost a static branch while disabled, enable them with
+ *   echo 1 > /sys/kernel/tracing/events/onewire/enable
+ * or record them with perf record -e 'onewire:*'
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM onewire
+
+#if !defined(_ONEWIRE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ONEWIRE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT (onewire_command,
+             TP_PROTO (const char *buf, size_t count),
+             TP_ARGS (buf, count),
+             TP_STRUCT__entry (__array (char, cmd, 8) __field (size_t, count)),
+             TP_fast_assign (memset (__entry->cmd, 0, sizeof (__entry->cmd));
+                             memcpy (__entry->cmd, buf, min (count, sizeof (__entry->cmd)));
+                             __entry->count = count;),
+             TP_printk ("cmd=%.8s count=%zu", __entry->cmd, __entry->count));
+
+TRACE_EVENT (onewire_reset,
+             TP_PROTO (s64 duration_us, u8 status),
+             TP_ARGS (duration_us, status),
+             TP_STRUCT__entry (__field (s64, duration_us) __field (u8, status)),
+             TP_fast_assign (__entry->duration_us = duration_us; __entry->status = status;),
+             TP_printk ("duration=%lldus status=%u", __entry->duration_us, __entry->status));
+
+TRACE_EVENT (onewire_convert,
+             TP_PROTO (u32 duration_us, bool done),
+             TP_ARGS (duration_us, done),
+             TP_STRUCT__entry (__field (u32, duration_us) __field (bool, done)),
+             TP_fast_assign (__entry->duration_us = duration_us; __entry->done = done;),
+             TP_printk ("duration=%uus %s", __entry->duration_us,
+                        __entry->done ? "done" : "TIMEOUT"));
+
+TRACE_EVENT (onewire_write_byte,
+             TP_PROTO (u8 byte),
+             TP_ARGS (byte),
+             TP_STRUCT__entry (__field (u8, byte)),
+             TP_fast_assign (__entry->byte = byte;),
+             TP_printk ("byte=0x%02x", __entry->byte));
+
+TRACE_EVENT (onewire_read_byte,
+             TP_PROTO (u8 byte),
+             TP_ARGS (byte),
+             TP_STRUCT__entry (__field (u8, byte)),
+             TP_fast_assign (__entry->byte = byte;),
+             TP_printk ("byte=0x%02x", __entry->byte));
+
+TRACE_EVENT (onewire_crc,
+             TP_PROTO (u8 computed, u8 received),
+             TP_ARGS (computed, received),
+             TP_STRUCT__entry (__field (u8, computed) __field (u8, received)),
+             TP_fast_assign (__entry->computed = computed; __entry->received = received;),
+             TP_printk ("computed=0x%02x received=0x%02x %s", __entry->computed,
+                        __entry->received, __entry->computed == __entry->received ? "ok" : "FAIL"));
+
+TRACE_EVENT (onewire_fifo,
+             TP_PROTO (unsigned int depth),
+             TP_ARGS (depth),
+             TP_STRUCT__entry (__field (unsigned int, depth)),
+             TP_fast_assign (__entry->depth = depth;),
+             TP_printk ("depth=%u", __entry->depth));
+
+#endif /* _ONEWIRE_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE onewire_trace
+#include <trace/define_trace.h>
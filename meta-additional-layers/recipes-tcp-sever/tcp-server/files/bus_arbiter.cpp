@@ -0,0 +1,114 @@
+#include "bus_arbiter.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace server;
+
+BusArbiter::BusArbiter (logger::Logger &log) : log_ (log)
+{
+    event_fd_ = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ < 0)
+    {
+        throw std::runtime_error ("Error creating eventfd " + std::string (std::strerror (errno)));
+    }
+    worker_ = std::thread (&BusArbiter::run, this);
+}
+
+BusArbiter::~BusArbiter ()
+{
+    shutdown ();
+    close (event_fd_);
+}
+
+/**
+ * Queues an operation, it is executed after all previously submitted ones
+ */
+void
+BusArbiter::submit (uint64_t connection, Operation op)
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        jobs_.push_back ({ connection, std::move (op) });
+    }
+    cv_.notify_one ();
+}
+
+/**
+ * Returns all finished results and resets the eventfd
+ */
+std::vector<BusResult>
+BusArbiter::take_results ()
+{
+    uint64_t counter;
+    while (read (event_fd_, &counter, sizeof (counter)) > 0)
+    {
+    }
+
+    std::vector<BusResult> ret;
+    std::lock_guard<std::mutex> lock (mutex_);
+    ret.swap (results_);
+    return ret;
+}
+
+/**
+ * Stops the worker, operations that did not start yet are dropped
+ */
+void
+BusArbiter::shutdown ()
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        stopping_ = true;
+        jobs_.clear ();
+    }
+    cv_.notify_one ();
+
+    if (worker_.joinable ())
+    {
+        worker_.join ();
+    }
+}
+
+void
+BusArbiter::run ()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock (mutex_);
+            cv_.wait (lock, [this] { return stopping_ || !jobs_.empty (); });
+            if (stopping_)
+            {
+                return;
+            }
+            job = std::move (jobs_.front ());
+            jobs_.pop_front ();
+        }
+
+        std::string data;
+        try
+        {
+            data = job.op ();
+        }
+        catch (const std::exception &e)
+        {
+            log_.error ("Bus operation failed: {}", e.what ());
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (mutex_);
+            results_.push_back ({ job.connection, std::move (data) });
+        }
+
+        uint64_t one = 1;
+        if (write (event_fd_, &one, sizeof (one)) < 0)
+        {
+            log_.error ("Error signalling eventfd {}", std::strerror (errno));
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+
+namespace server
+{
+
+/**
+ * Result of one bus operation, addressed to the connection that requested it
+ */
+struct BusResult
+{
+    uint64_t connection;
+    std::string data;
+};
+
+/**
+ * Owns the 1-Wire bus
+ * All device operations of all connections run one after another on a single
+ * worker thread. Finished results are collected and signalled via an eventfd
+ * so the reactor can pick them up in its event loop.
+ */
+class BusArbiter
+{
+  public:
+    using Operation = std::function<std::string ()>;
+
+    // connection id for internal operations, their results are discarded
+    static constexpr uint64_t no_connection = 0;
+
+    explicit BusArbiter (logger::Logger &log);
+    ~BusArbiter ();
+
+    BusArbiter (const BusArbiter &) = delete;
+    BusArbiter &operator= (const BusArbiter &) = delete;
+
+    /**
+     * File descriptor that becomes readable when results are available
+     */
+    int
+    event_fd () const
+    {
+        return event_fd_;
+    }
+
+    void submit (uint64_t connection, Operation op);
+    std::vector<BusResult> take_results ();
+    void shutdown ();
+
+  private:
+    struct Job
+    {
+        uint64_t connection;
+        Operation op;
+    };
+
+    void run ();
+
+    logger::Logger &log_;
+    int event_fd_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> jobs_;
+    std::vector<BusResult> results_;
+    bool stopping_ = false;
+
+    std::thread worker_;
+};
+
+}
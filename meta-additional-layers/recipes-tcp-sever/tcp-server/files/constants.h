@@ -1,6 +1,236 @@
 
 #pragma once
 
+/**
+ * ioctl interface of /dev/onewire_devN, one device per 1-Wire bus
+ * Shared by the driver (C) and tcp-server (C++), every ioctl runs exactly one
+ * bus transaction and fills a fixed struct, no text parsing involved.
+ * Bus errors are reported in the status field, the ioctl itself only fails
+ * for bad arguments.
+ */
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define ONEWIRE_IOC_MAGIC 'w'
+
+#define ONEWIRE_ROM_SIZE 8
+#define ONEWIRE_SCRATCHPAD_SIZE 9
+
+// status of a transaction, also stored in the result records of read()
+#define ONEWIRE_STATUS_OK 0
+#define ONEWIRE_STATUS_CRC_ERROR 1 // the CRC of the read data did not match
+#define ONEWIRE_STATUS_TIMEOUT 2   // the device did not finish in time
+#define ONEWIRE_STATUS_NO_DEVICE 3 // no presence pulse after the reset
+#define ONEWIRE_STATUS_BUS_SHORT 4 // the line stayed low after the reset
+
+// DS18B20 resolution in bits, 94 ms conversion at 9 bit up to 750 ms at 12 bit
+#define ONEWIRE_RESOLUTION_MIN 9
+#define ONEWIRE_RESOLUTION_MAX 12
+
+// onewire_ioc_config.flags
+#define ONEWIRE_CONFIG_CRC_RETRY 0x1 // repeat transactions with a CRC error
+
+/**
+ * Addresses one device with match ROM, or the only device on the bus with
+ * skip ROM if use_rom is 0
+ */
+struct onewire_ioc_target
+{
+    __u8 rom[ONEWIRE_ROM_SIZE];
+    __u8 use_rom;
+    __u8 reserved[7];
+};
+
+struct onewire_ioc_reset
+{
+    __u32 duration_us;
+    __u8 status;
+    __u8 reserved[3];
+};
+
+struct onewire_ioc_rom
+{
+    __u8 rom[ONEWIRE_ROM_SIZE]; // family code first, CRC last
+    __u8 status;
+    __u8 reserved[7];
+};
+
+struct onewire_ioc_scratchpad
+{
+    struct onewire_ioc_target target;
+    __u8 data[ONEWIRE_SCRATCHPAD_SIZE]; // temperature LSB first, CRC last
+    __u8 status;
+    __u8 reserved[6];
+};
+
+struct onewire_ioc_write_scratchpad
+{
+    struct onewire_ioc_target target;
+    __u8 th;
+    __u8 tl;
+    __u8 config;
+    __u8 status;
+    __u8 reserved[4];
+};
+
+struct onewire_ioc_convert
+{
+    struct onewire_ioc_target target;
+    __u32 conversion_us; // measured by the driver, the ioctl returns after the conversion
+    __u8 status;
+    __u8 reserved[3];
+};
+
+struct onewire_ioc_resolution
+{
+    struct onewire_ioc_target target;
+    __u8 bits;    // ONEWIRE_RESOLUTION_MIN to ONEWIRE_RESOLUTION_MAX
+    __u8 persist; // set: copy the setting to the EEPROM
+    __u8 status;
+    __u8 reserved;
+    __u32 conversion_ms; // nominal conversion time at the resolution
+};
+
+/**
+ * With ONEWIRE_CONFIG_CRC_RETRY a transaction failing its CRC check is
+ * repeated up to retry_max times, first after retry_first_ms, the delay
+ * doubles up to retry_max_delay_ms, no retry starts after retry_deadline_ms
+ */
+struct onewire_ioc_config
+{
+    __u32 flags; // ONEWIRE_CONFIG_*
+    __u16 retry_max;
+    __u16 retry_first_ms;
+    __u16 retry_max_delay_ms;
+    __u16 retry_deadline_ms;
+};
+
+// onewire_ioc_transaction
+#define ONEWIRE_TRANSACTION_MAX 64
+#define ONEWIRE_TRANSACTION_RESET 0x1    // start with a reset pulse
+#define ONEWIRE_TRANSACTION_NO_RETRY 0x2 // never repeat, for commands with side effects
+#define ONEWIRE_CRC_NONE 0
+#define ONEWIRE_CRC8 1  // one CRC byte, as in ROM IDs and DS18B20 scratchpads
+#define ONEWIRE_CRC16 2 // two inverted CRC bytes LSB first, as in DS2408 or DS2438 reads
+
+/**
+ * Generic transaction for any 1-Wire device: an optional reset, write_len
+ * bytes written and read_len bytes read. With crc set, the CRC of crc_len
+ * bytes starting at crc_start is checked, counted in the written bytes
+ * followed by the read bytes. The CRC bytes come right after that span and
+ * have to be part of the read data.
+ * With ONEWIRE_CONFIG_CRC_RETRY a CRC error repeats the whole transaction,
+ * the write included, but only if it starts with a reset. Set
+ * ONEWIRE_TRANSACTION_NO_RETRY when the write must not run twice, e.g. a
+ * DS2408 channel access write or a DS2438 copy scratchpad.
+ */
+struct onewire_ioc_transaction
+{
+    __u8 flags; // ONEWIRE_TRANSACTION_*
+    __u8 crc;   // ONEWIRE_CRC_*
+    __u8 write_len;
+    __u8 read_len;
+    __u8 crc_start;
+    __u8 crc_len;
+    __u8 status;
+    __u8 reserved;
+    __u8 write_data[ONEWIRE_TRANSACTION_MAX];
+    __u8 read_data[ONEWIRE_TRANSACTION_MAX];
+};
+
+/**
+ * One result record of the write() interface, read() only returns data
+ * Also the record format of the mmap ring
+ */
+struct onewire_ioc_result
+{
+    __u32 seq; // sequence number of the command, see onewire_ioc_sequence
+    __u8 status;
+    __u8 size; // valid bytes in data
+    __u8 reserved[2];
+    __u64 timestamp_ns; // CLOCK_MONOTONIC when the result was produced
+    __u8 data[8];
+};
+
+/**
+ * write() queues a command and returns before it runs, the commands get
+ * consecutive sequence numbers starting at 1 (0 is skipped on wrap around)
+ * ONEWIRE_IOC_WAIT_SEQUENCE waits up to timeout_ms until command seq has
+ * finished, seq 0 waits for all commands written so far. It always returns
+ * the last submitted and the last completed sequence number.
+ */
+struct onewire_ioc_sequence
+{
+    __u32 seq;
+    __u32 timeout_ms;
+    __u32 submitted;
+    __u32 completed;
+};
+
+/**
+ * Result ring shared with userspace by mmap () of ONEWIRE_RING_MAP_SIZE bytes
+ * While the ring is mapped the results of the write () interface go to the
+ * ring instead of read (). The driver produces records at head, userspace
+ * consumes them at tail. Both indices run freely, the record of index i is
+ * record[i % ONEWIRE_RING_RECORDS]. Userspace loads head with acquire and
+ * stores tail with release ordering, poll () reports POLLIN while head != tail.
+ * Once the results queued before the mmap are taken, read () and
+ * ONEWIRE_IOC_READ_RESULT fail with EBUSY while the ring is mapped. Records
+ * still in the ring at the last munmap () are dropped. The FLUSH command only
+ * clears the FIFO of read (), the ring is emptied by its consumer alone.
+ */
+#define ONEWIRE_RING_RECORDS 256
+#define ONEWIRE_RING_MAP_SIZE 8192
+
+struct onewire_ring_header
+{
+    __u32 head;        // written by the driver
+    __u32 tail;        // written by userspace
+    __u32 records;     // ONEWIRE_RING_RECORDS
+    __u32 record_size; // sizeof (struct onewire_ioc_result)
+    __u32 dropped;     // results lost because the ring was full
+    __u32 reserved[11];
+};
+
+struct onewire_ring
+{
+    struct onewire_ring_header header;
+    struct onewire_ioc_result record[ONEWIRE_RING_RECORDS];
+};
+
+struct onewire_ioc_stats
+{
+    __u64 transactions;
+    __u64 resets;
+    __u64 crc_errors;   // every failed CRC check
+    __u64 retries;      // attempts repeated after a CRC error
+    __u64 crc_failures; // transactions with ONEWIRE_STATUS_CRC_ERROR after all retries
+    __u64 no_presence;  // resets answered by no device
+    __u64 bus_shorts;   // resets that found the line stuck low
+    __u64 results_dropped; // results of the write() interface lost on a full FIFO
+    __u64 irq_off_ns;      // local IRQs disabled by the bit engine, total
+    __u64 irq_off_last_ns; // of the last transaction
+    __u64 irq_off_max_ns;  // of the longest transaction
+    __u32 fifo_len;
+    __u32 reserved;
+};
+
+#define ONEWIRE_IOC_RESET _IOR (ONEWIRE_IOC_MAGIC, 1, struct onewire_ioc_reset)
+#define ONEWIRE_IOC_READ_ROM _IOR (ONEWIRE_IOC_MAGIC, 2, struct onewire_ioc_rom)
+#define ONEWIRE_IOC_READ_SCRATCHPAD _IOWR (ONEWIRE_IOC_MAGIC, 3, struct onewire_ioc_scratchpad)
+#define ONEWIRE_IOC_WRITE_SCRATCHPAD                                                              \
+    _IOWR (ONEWIRE_IOC_MAGIC, 4, struct onewire_ioc_write_scratchpad)
+#define ONEWIRE_IOC_CONVERT _IOWR (ONEWIRE_IOC_MAGIC, 5, struct onewire_ioc_convert)
+#define ONEWIRE_IOC_GET_CONFIG _IOR (ONEWIRE_IOC_MAGIC, 6, struct onewire_ioc_config)
+#define ONEWIRE_IOC_SET_CONFIG _IOW (ONEWIRE_IOC_MAGIC, 7, struct onewire_ioc_config)
+#define ONEWIRE_IOC_GET_STATS _IOR (ONEWIRE_IOC_MAGIC, 8, struct onewire_ioc_stats)
+#define ONEWIRE_IOC_SET_RESOLUTION _IOWR (ONEWIRE_IOC_MAGIC, 9, struct onewire_ioc_resolution)
+#define ONEWIRE_IOC_GET_RESOLUTION _IOWR (ONEWIRE_IOC_MAGIC, 10, struct onewire_ioc_resolution)
+#define ONEWIRE_IOC_READ_RESULT _IOR (ONEWIRE_IOC_MAGIC, 11, struct onewire_ioc_result)
+#define ONEWIRE_IOC_WAIT_SEQUENCE _IOWR (ONEWIRE_IOC_MAGIC, 12, struct onewire_ioc_sequence)
+#define ONEWIRE_IOC_TRANSACTION _IOWR (ONEWIRE_IOC_MAGIC, 13, struct onewire_ioc_transaction)
+
+#ifdef __cplusplus
 
 #include <string>
 
@@ -8,28 +238,6 @@ namespace demon_constant {
 
     const std::string device_name = "/dev/onewire_dev";
 
-    class onewire_data {
-        public:
-        char cmd[2];
-    };
-
-    class onewire_read_address : public onewire_data {
-        public:
-            const char cmd = 0x33;
-            char result[8];
-    };
-    
-
-    class onewire_write : public onewire_data {
-        public: 
-            const char cmd[2] = { (char) 0xCC, (char) 0x4E};
-            char result[8];
-    };
-
-    class onewire_read : public onewire_data {
-        public:
-            const char cmd[2] = { (char) 0xCC, (char) 0xBE};
-            char result[8];
-    };
-
-};
\ No newline at end of file
+};
+
+#endif
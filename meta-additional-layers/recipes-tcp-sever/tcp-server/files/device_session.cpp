@@ -0,0 +1,306 @@
+#include "device_session.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "constants.h"
+
+using namespace server;
+
+// longest time a queued write() command may take, a batch read of many sensors
+static constexpr __u32 command_timeout_ms = 30000;
+
+DeviceSession::DeviceSession (std::string device_name) : device_name_ (std::move (device_name))
+{
+}
+
+DeviceSession::~DeviceSession () { close_device (); }
+
+/**
+ * Lists the bus devices device_name followed by a number, the driver creates
+ * one per 1-Wire bus, sorted by that number
+ * Falls back to device_name itself if there is no numbered device.
+ */
+std::vector<std::string>
+DeviceSession::discover (const std::string &device_name)
+{
+    std::filesystem::path base (device_name);
+    std::string prefix = base.filename ().string ();
+    std::vector<std::pair<unsigned long, std::string>> found;
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator (base.parent_path (), ec))
+    {
+        std::string name = entry.path ().filename ().string ();
+        if (name.size () <= prefix.size () || name.compare (0, prefix.size (), prefix) != 0)
+        {
+            continue;
+        }
+
+        std::string number = name.substr (prefix.size ());
+        if (!std::all_of (number.begin (), number.end (), ::isdigit))
+        {
+            continue;
+        }
+        found.emplace_back (std::stoul (number), entry.path ().string ());
+    }
+    std::sort (found.begin (), found.end ());
+
+    std::vector<std::string> devices;
+    for (auto &[number, path] : found)
+    {
+        devices.push_back (std::move (path));
+    }
+    if (devices.empty ())
+    {
+        devices.push_back (device_name);
+    }
+    return devices;
+}
+
+void
+DeviceSession::open_device ()
+{
+    // non-blocking, an empty result FIFO ends a transaction with EAGAIN
+    fd_ = open (device_name_.c_str (), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd_ < 0)
+    {
+        throw std::runtime_error ("Error: onewire_driver is not open "
+                                  + std::string (std::strerror (errno)));
+    }
+
+    // while the ring is mapped the driver puts its results there
+    void *ring = mmap (nullptr, ONEWIRE_RING_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    ring_ = ring == MAP_FAILED ? nullptr : static_cast<onewire_ring *> (ring);
+
+    // results of commands written before are not ours
+    onewire_ioc_sequence sequence = {};
+    seq_ = ioctl_retry (ONEWIRE_IOC_WAIT_SEQUENCE, &sequence) ? sequence.submitted : 0;
+}
+
+void
+DeviceSession::close_device ()
+{
+    if (ring_)
+    {
+        munmap (ring_, ONEWIRE_RING_MAP_SIZE);
+        ring_ = nullptr;
+    }
+    if (fd_ >= 0)
+    {
+        close (fd_);
+        fd_ = -1;
+    }
+}
+
+/**
+ * Writes the command and reads all result records
+ * The command may be several driver commands separated by ';', the results
+ * of all of them are returned in order.
+ * The device is reopened once if the write or a read fails.
+ */
+std::string
+DeviceSession::transact (const std::vector<char> &command)
+{
+    std::string ret;
+
+    if (fd_ < 0)
+    {
+        open_device ();
+    }
+
+    if (!try_transact (command, ret))
+    {
+        close_device ();
+        open_device ();
+
+        ret.clear ();
+        if (!try_transact (command, ret))
+        {
+            int err = errno;
+            close_device ();
+            throw std::runtime_error ("Error: onewire_driver transaction failed "
+                                      + std::string (std::strerror (err)));
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Runs one ioctl of the driver interface in constants.h
+ * The device is reopened once if the ioctl fails with an I/O error.
+ */
+void
+DeviceSession::control (unsigned long request, void *arg)
+{
+    if (fd_ < 0)
+    {
+        open_device ();
+    }
+
+    bool ok = ioctl_retry (request, arg);
+
+    if (!ok && (errno == EIO || errno == EBADF))
+    {
+        close_device ();
+        open_device ();
+
+        ok = ioctl_retry (request, arg);
+    }
+
+    if (!ok)
+    {
+        throw std::runtime_error ("Error: onewire_driver ioctl failed "
+                                  + std::string (std::strerror (errno)));
+    }
+}
+
+/**
+ * Writes the commands and collects their results
+ * The driver queues what fits into its command queue and returns the bytes of
+ * the queued commands, the rest is written once those have run.
+ * returns false on an I/O error, errno is set
+ */
+bool
+DeviceSession::try_transact (const std::vector<char> &command, std::string &ret)
+{
+    size_t done = 0;
+    while (true)
+    {
+        ssize_t written = pwrite (fd_, command.data () + done, command.size () - done, 0);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0 && errno != EAGAIN)
+        {
+            return false;
+        }
+        if (written == 0)
+        {
+            // the driver took nothing without an error, it would never make progress
+            errno = EIO;
+            return false;
+        }
+        if (written > 0)
+        {
+            done += written;
+        }
+
+        // write() only queues the commands, wait until the driver has run them
+        onewire_ioc_sequence sequence = {};
+        sequence.timeout_ms = command_timeout_ms;
+        if (!ioctl_retry (ONEWIRE_IOC_WAIT_SEQUENCE, &sequence))
+        {
+            return false;
+        }
+        if ((int32_t)(sequence.completed - sequence.submitted) < 0)
+        {
+            errno = ETIMEDOUT;
+            return false;
+        }
+
+        bool ok = take_results (sequence.submitted, ret);
+        seq_ = sequence.submitted;
+        if (!ok || done == command.size ())
+        {
+            return ok;
+        }
+    }
+}
+
+/**
+ * returns true if seq belongs to the commands after seq_ up to last
+ */
+bool
+DeviceSession::wanted (uint32_t seq, uint32_t last) const
+{
+    return (int32_t)(seq - seq_) > 0 && (int32_t)(seq - last) <= 0;
+}
+
+/**
+ * Appends the data of all queued results of the commands up to last to ret
+ * Every record is one result, records of earlier commands are left over from
+ * a transaction that timed out and are dropped.
+ * returns false on an I/O error, errno is set
+ */
+bool
+DeviceSession::take_results (uint32_t last, std::string &ret)
+{
+    if (ring_)
+    {
+        take_ring_results (last, ret);
+        return true;
+    }
+
+    while (true)
+    {
+        onewire_ioc_result result = {};
+        if (!ioctl_retry (ONEWIRE_IOC_READ_RESULT, &result))
+        {
+            return errno == EAGAIN;
+        }
+        if (wanted (result.seq, last))
+        {
+            ret.append ((const char *)result.data,
+                        std::min<size_t> (result.size, sizeof (result.data)));
+        }
+    }
+}
+
+/**
+ * Consumes every record between tail and head of the mapped ring
+ * The driver publishes head with release ordering, so the records before it
+ * are complete once head is loaded with acquire ordering.
+ */
+void
+DeviceSession::take_ring_results (uint32_t last, std::string &ret)
+{
+    std::atomic_ref<__u32> head (ring_->header.head);
+    std::atomic_ref<__u32> tail (ring_->header.tail);
+
+    __u32 end = head.load (std::memory_order_acquire);
+    __u32 index = tail.load (std::memory_order_relaxed);
+    // the driver never runs more than one ring ahead, guards against a bad tail
+    if (end - index > ONEWIRE_RING_RECORDS)
+    {
+        index = end - ONEWIRE_RING_RECORDS;
+    }
+
+    for (; index != end; index++)
+    {
+        const onewire_ioc_result &result = ring_->record[index % ONEWIRE_RING_RECORDS];
+        if (wanted (result.seq, last))
+        {
+            ret.append ((const char *)result.data,
+                        std::min<size_t> (result.size, sizeof (result.data)));
+        }
+    }
+
+    tail.store (end, std::memory_order_release);
+}
+
+/**
+ * ioctl restarted on EINTR, returns false on an error, errno is set
+ */
+bool
+DeviceSession::ioctl_retry (unsigned long request, void *arg)
+{
+    int ret;
+    do
+    {
+        ret = ioctl (fd_, request, arg);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret == 0;
+}
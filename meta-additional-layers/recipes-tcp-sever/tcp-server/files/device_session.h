@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct onewire_ring;
+
+namespace server
+{
+
+/**
+ * Keeps one /dev/onewire_devN open for the life of the process
+ * The driver allows only one opener, holding the fd keeps other processes
+ * from grabbing the device between two commands. Not thread safe, in the
+ * server only the BusArbiter thread uses the session.
+ * Results are taken from the driver's mmap ring without a system call per
+ * record, drivers without the ring are read with ONEWIRE_IOC_READ_RESULT.
+ */
+class DeviceSession
+{
+  public:
+    explicit DeviceSession (std::string device_name);
+    ~DeviceSession ();
+
+    DeviceSession (const DeviceSession &) = delete;
+    DeviceSession &operator= (const DeviceSession &) = delete;
+
+    std::string transact (const std::vector<char> &command);
+    void control (unsigned long request, void *arg);
+
+    static std::vector<std::string> discover (const std::string &device_name);
+
+  private:
+    void open_device ();
+    void close_device ();
+    bool try_transact (const std::vector<char> &command, std::string &ret);
+    bool take_results (uint32_t last, std::string &ret);
+    void take_ring_results (uint32_t last, std::string &ret);
+    bool wanted (uint32_t seq, uint32_t last) const;
+    bool ioctl_retry (unsigned long request, void *arg);
+
+    std::string device_name_;
+    int fd_ = -1;
+    onewire_ring *ring_ = nullptr; // mapped result ring, nullptr if not supported
+    uint32_t seq_ = 0;             // sequence number of the last command before this transaction
+};
+
+}
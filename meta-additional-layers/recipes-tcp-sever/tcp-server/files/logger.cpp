@@ -19,4 +19,145 @@ LogFile::~LogFile ()
     {
         this->fs.close ();
     }
-}
\ No newline at end of file
+}
+
+void
+logger::format_string_error (const char *reason)
+{
+    throw std::logic_error (reason);
+}
+
+LogAsync::LogAsync (std::unique_ptr<LogSink> sink)
+    : sink_ (std::move (sink)), slots_ (std::make_unique<Slot[]> (capacity))
+{
+    for (size_t i = 0; i < capacity; i++)
+    {
+        slots_[i].sequence.store (i, std::memory_order_relaxed);
+    }
+    writer_ = std::thread (&LogAsync::run, this);
+}
+
+LogAsync::~LogAsync ()
+{
+    stopping_.store (true, std::memory_order_release);
+    wake_.fetch_add (1, std::memory_order_release);
+    wake_.notify_one ();
+    if (writer_.joinable ())
+    {
+        writer_.join ();
+    }
+}
+
+/**
+ * Copies the record into the ring, never blocks
+ * Multiple threads may write at the same time. Records longer than
+ * record_size are truncated.
+ */
+void
+LogAsync::write (std::string_view s)
+{
+    size_t pos = enqueue_pos_.load (std::memory_order_relaxed);
+    Slot *slot;
+
+    while (true)
+    {
+        slot = &slots_[pos & (capacity - 1)];
+        size_t seq = slot->sequence.load (std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (enqueue_pos_.compare_exchange_weak (pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        { // the writer thread did not free this slot yet
+            dropped_.fetch_add (1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = enqueue_pos_.load (std::memory_order_relaxed);
+        }
+    }
+
+    size_t length = std::min (s.size (), record_size);
+    std::memcpy (slot->text, s.data (), length);
+    if (length == record_size && s.size () > record_size)
+    {
+        slot->text[record_size - 1] = '\n';
+    }
+    slot->length = (uint16_t)length;
+
+    slot->sequence.store (pos + 1, std::memory_order_release);
+
+    // pairs with the fence in run (), either the writer sees the record or we see it sleeping
+    std::atomic_thread_fence (std::memory_order_seq_cst);
+    if (sleeping_.load (std::memory_order_relaxed))
+    {
+        wake_.fetch_add (1, std::memory_order_release);
+        wake_.notify_one ();
+    }
+}
+
+bool
+LogAsync::try_pop (Slot *&slot)
+{
+    slot = &slots_[dequeue_pos_ & (capacity - 1)];
+    return slot->sequence.load (std::memory_order_acquire) == dequeue_pos_ + 1;
+}
+
+void
+LogAsync::release (Slot &slot)
+{
+    slot.sequence.store (dequeue_pos_ + capacity, std::memory_order_release);
+    dequeue_pos_++;
+}
+
+/**
+ * Drains the ring into the sink, the remaining records are written on shutdown
+ * Sleeps without a timeout while the ring is empty, write () wakes it up
+ */
+void
+LogAsync::run ()
+{
+    uint64_t reported_dropped = 0;
+
+    while (true)
+    {
+        bool stopping = stopping_.load (std::memory_order_acquire);
+
+        Slot *slot;
+        size_t written = 0;
+        while (try_pop (slot))
+        {
+            sink_->write (std::string_view (slot->text, slot->length));
+            release (*slot);
+            written++;
+        }
+
+        uint64_t dropped = dropped_.load (std::memory_order_relaxed);
+        if (dropped != reported_dropped)
+        {
+            sink_->write ("Log: dropped " + std::to_string (dropped - reported_dropped)
+                          + " records\n");
+            reported_dropped = dropped;
+        }
+
+        if (stopping)
+        {
+            return;
+        }
+        if (written == 0)
+        {
+            uint32_t wake = wake_.load (std::memory_order_acquire);
+            sleeping_.store (true, std::memory_order_relaxed);
+            std::atomic_thread_fence (std::memory_order_seq_cst);
+            if (!try_pop (slot) && !stopping_.load (std::memory_order_acquire))
+            {
+                wake_.wait (wake, std::memory_order_acquire);
+            }
+            sleeping_.store (false, std::memory_order_relaxed);
+        }
+    }
+}
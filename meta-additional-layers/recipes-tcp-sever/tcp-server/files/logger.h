@@ -1,12 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
 #include <memory>
-#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 
 namespace logger
 {
@@ -17,7 +26,7 @@ namespace logger
 struct LogSink
 {
     virtual ~LogSink () = default;
-    virtual void write (const std::string &s) = 0;
+    virtual void write (std::string_view s) = 0;
 };
 
 /**
@@ -26,7 +35,7 @@ struct LogSink
 class LogCout : public LogSink
 {
     void
-    write (const std::string &s)
+    write (std::string_view s)
     {
         std::cout << s;
     }
@@ -46,7 +55,7 @@ class LogFile : public LogSink
     explicit LogFile (std::string logging_path, std::string filename);
     ~LogFile ();
     void
-    write (const std::string &s)
+    write (std::string_view s)
     {
         if (this->fs.is_open ())
         {
@@ -60,65 +69,296 @@ class LogFile : public LogSink
 };
 
 /**
- * Logger class
- * can be used Logger.log("msg ", var0, " msg 2 ", var1);
+ * Hands records to a background thread that writes them to another sink
+ * Records are copied into a bounded lock-free ring, so the caller never waits
+ * for stdout or the SD card. If the ring is full the record is dropped and
+ * counted, the number of dropped records is logged once space is free again.
+ * The writer thread sleeps on wake_ while the ring is empty, a record only
+ * notifies it if it is actually sleeping.
  */
-class Logger
+class LogAsync : public LogSink
 {
+  public:
+    static constexpr size_t capacity = 1024; // power of 2
+    static constexpr size_t record_size = 240;
+
+    explicit LogAsync (std::unique_ptr<LogSink> sink);
+    ~LogAsync ();
+
+    LogAsync (const LogAsync &) = delete;
+    LogAsync &operator= (const LogAsync &) = delete;
+
+    void write (std::string_view s);
+
+    uint64_t
+    dropped () const
+    {
+        return dropped_.load (std::memory_order_relaxed);
+    }
 
   private:
+    struct Slot
+    {
+        std::atomic<size_t> sequence;
+        uint16_t length;
+        char text[record_size];
+    };
+
+    bool try_pop (Slot *&slot);
+    void release (Slot &slot);
+    void run ();
+
     std::unique_ptr<LogSink> sink_;
+    std::unique_ptr<Slot[]> slots_;
+
+    alignas (64) std::atomic<size_t> enqueue_pos_{ 0 };
+    alignas (64) size_t dequeue_pos_ = 0; // only used by the writer thread
+    std::atomic<uint64_t> dropped_{ 0 };
+    std::atomic<bool> stopping_{ false };
+    std::atomic<bool> sleeping_{ false }; // the writer thread waits on wake_
+    std::atomic<uint32_t> wake_{ 0 };
+
+    std::thread writer_;
+};
+
+/**
+ * Log levels, calls below LOGGER_MIN_LEVEL are removed at compile time
+ */
+enum class Level : int
+{
+    debug = 0,
+    info = 1,
+    warning = 2,
+    error = 3,
+};
+
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL 0
+#endif
+
+constexpr Level min_level = (Level)LOGGER_MIN_LEVEL;
+
+// not constexpr, calling it while checking a format string is a compile error
+void format_string_error (const char *reason);
+
+/**
+ * Format string with "{}" placeholders, "{{" and "}}" are literal braces
+ * The number of placeholders is checked against the arguments at compile time.
+ */
+template <typename... Args> struct FormatString
+{
+    std::string_view str;
 
+    template <typename S>
+        requires std::convertible_to<const S &, std::string_view>
+    consteval FormatString (const S &s) : str (s)
+    {
+        size_t placeholders = 0;
+        for (size_t i = 0; i < str.size (); i++)
+        {
+            if (str[i] == '{')
+            {
+                if (i + 1 < str.size () && str[i + 1] == '{')
+                    i++;
+                else if (i + 1 < str.size () && str[i + 1] == '}')
+                    i++, placeholders++;
+                else
+                    format_string_error ("only {} placeholders are supported");
+            }
+            else if (str[i] == '}')
+            {
+                if (i + 1 < str.size () && str[i + 1] == '}')
+                    i++;
+                else
+                    format_string_error ("unmatched }");
+            }
+        }
+        if (placeholders != sizeof...(Args))
+        {
+            format_string_error ("placeholder count does not match the arguments");
+        }
+    }
+};
+
+template <typename... Args>
+using format_string = FormatString<std::type_identity_t<Args>...>;
+
+/**
+ * Fixed size line buffer, one per thread, output beyond its size is cut off
+ */
+class LineBuffer
+{
   public:
-    explicit Logger (std::unique_ptr<LogSink> sink) : sink_ (std::move (sink)) {}
+    static constexpr size_t size = 512;
 
-    ~Logger () = default;
+    void
+    clear ()
+    {
+        len_ = 0;
+    }
+
+    std::string_view
+    view () const
+    {
+        return { buf_, len_ };
+    }
 
     void
-    log (std::string msg)
+    append (std::string_view s)
     {
-        std::time_t result = std::time (nullptr);
-        std::ostringstream string_builder ("", std::ios_base::ate);
-        string_builder << "Log[" << std::put_time (std::localtime (&result), "%Y-%m-%d %H:%M:%S")
-                       << "]: " << msg << "\n";
-        sink_->write (string_builder.str ());
+        size_t n = std::min (s.size (), size - len_);
+        std::memcpy (buf_ + len_, s.data (), n);
+        len_ += n;
     }
 
-    std::string
-    convert_to_string (const char *t)
+    void
+    append (char c)
     {
-        std::string s{ t };
-        return s;
+        if (len_ < size)
+            buf_[len_++] = c;
     }
 
-    std::string
-    convert_to_string (char *t)
+    void
+    append (const char *s)
     {
-        std::string s{ t };
-        return s;
+        append (std::string_view (s ? s : "(null)"));
     }
 
-    std::string
-    convert_to_string (std::string t)
+    void
+    append (bool b)
     {
-        std::string s{ t };
-        return s;
+        append (std::string_view (b ? "true" : "false"));
     }
 
     template <typename T>
-    std::string
-    convert_to_string (T t)
+        requires std::is_arithmetic_v<T>
+    void
+    append (T v)
     {
-        return std::to_string (t);
+        auto [end, ec] = std::to_chars (buf_ + len_, buf_ + size, v);
+        if (ec == std::errc ())
+            len_ = end - buf_;
+    }
+
+  private:
+    char buf_[size];
+    size_t len_ = 0;
+};
+
+/**
+ * Logger class
+ * can be used log.info ("msg {} msg 2 {}", var0, var1);
+ * Formatting happens in a per thread buffer, the "Log[date time]: " prefix is
+ * only rebuilt when the second changes.
+ */
+class Logger
+{
+
+  private:
+    std::unique_ptr<LogSink> sink_;
+
+    struct Prefix
+    {
+        std::time_t second = -1;
+        char text[40];
+        size_t len = 0;
+    };
+
+    static void
+    append_prefix (LineBuffer &line)
+    {
+        thread_local Prefix prefix;
+
+        std::time_t now = std::time (nullptr);
+        if (now != prefix.second)
+        {
+            std::tm local_time;
+            localtime_r (&now, &local_time); // log() is called from several threads
+            prefix.len = std::strftime (prefix.text, sizeof (prefix.text),
+                                        "Log[%Y-%m-%d %H:%M:%S]: ", &local_time);
+            prefix.second = now;
+        }
+        line.append (std::string_view (prefix.text, prefix.len));
+    }
+
+    static void
+    format_into (LineBuffer &line, std::string_view fmt)
+    {
+        for (size_t i = 0; i < fmt.size (); i++)
+        {
+            line.append (fmt[i]);
+            if ((fmt[i] == '{' || fmt[i] == '}') && i + 1 < fmt.size () && fmt[i + 1] == fmt[i])
+                i++;
+        }
     }
 
     template <typename T0, typename... T>
+    static void
+    format_into (LineBuffer &line, std::string_view fmt, const T0 &t0, const T &...t)
+    {
+        for (size_t i = 0; i < fmt.size (); i++)
+        {
+            if (fmt[i] == '{' && fmt[i + 1] == '}')
+            {
+                line.append (t0);
+                format_into (line, fmt.substr (i + 2), t...);
+                return;
+            }
+            line.append (fmt[i]);
+            if ((fmt[i] == '{' || fmt[i] == '}') && fmt[i + 1] == fmt[i])
+                i++;
+        }
+    }
+
+    template <typename... T>
+    void
+    write (std::string_view fmt, const T &...t)
+    {
+        thread_local LineBuffer line;
+
+        line.clear ();
+        append_prefix (line);
+        format_into (line, fmt, t...);
+        line.append ('\n');
+        sink_->write (line.view ());
+    }
+
+  public:
+    explicit Logger (std::unique_ptr<LogSink> sink) : sink_ (std::move (sink)) {}
+
+    ~Logger () = default;
+
+    template <typename... T>
+    void
+    debug (format_string<T...> fmt, const T &...t)
+    {
+        if constexpr (Level::debug >= min_level)
+            write (fmt.str, t...);
+    }
+
+    template <typename... T>
+    void
+    info (format_string<T...> fmt, const T &...t)
+    {
+        if constexpr (Level::info >= min_level)
+            write (fmt.str, t...);
+    }
+
+    template <typename... T>
+    void
+    warning (format_string<T...> fmt, const T &...t)
+    {
+        if constexpr (Level::warning >= min_level)
+            write (fmt.str, t...);
+    }
+
+    template <typename... T>
     void
-    log (std::string msg, T0 t0, T... t)
+    error (format_string<T...> fmt, const T &...t)
     {
-        msg.append (convert_to_string (t0));
-        log (msg, t...);
+        if constexpr (Level::error >= min_level)
+            write (fmt.str, t...);
     }
 };
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,4 @@
-#include <fstream>
 #include <iostream>
-#include <poll.h>
 #include <sstream>
 #include <string>
 
@@ -17,8 +15,13 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "bus_arbiter.h"
 #include "constants.h"
+#include "device_session.h"
 #include "logger.h"
+#include "reactor.h"
+#include "sampler.h"
+#include "series_store.h"
 #include <cstring>
 #include <vector>
 
@@ -26,12 +29,14 @@
 #define DRIVER_PATH "/dev/onewire_dev"
 
 #define PORT 1033
+#define SAMPLE_PERIOD_MS 5000
+#define HISTORY_PATH "/var/lib/tcp-server/temperature.series"
 #define BUFFER_SIZE 512
 
 volatile sig_atomic_t stop = 0;
 
-int server_fd, new_socket;
-struct sockaddr_in server_addr, client_addr;
+int server_fd;
+struct sockaddr_in server_addr;
 
 /**
  * Signal handling
@@ -46,19 +51,6 @@ handle_signal (int sig)
     }
 }
 
-std::vector<char>
-convert_to_bvec (std::string in)
-{
-    std::vector<char> r;
-    r.reserve (in.length ());
-
-    for (char c : in)
-    {
-        r.push_back (c);
-    }
-    return r;
-}
-
 /**
  * Creates a tcp server
  */
@@ -93,92 +85,14 @@ create_server (logger::Logger &log)
         exit (EXIT_FAILURE);
     }
     // Start listening for incoming connections
-    if (listen (server_fd, 1) < 0)
+    if (listen (server_fd, SOMAXCONN) < 0)
     {
         perror ("listen");
         exit (EXIT_FAILURE);
     }
 
-    log.log ("Created TCP server");
-    log.log ("Server listening on port ", PORT);
-}
-
-/**
- * Accepts a new connection
- */
-int
-wait_for_conenction (logger::Logger &log)
-{
-
-    struct pollfd pfd{ .fd = server_fd, .events = POLLIN };
-    socklen_t client_addr_len = sizeof (client_addr);
-
-    while (!stop)
-    {
-        int rcv = poll (&pfd, 1, 300); // 300ms
-
-        if (rcv < 0)
-        {
-            return -1;
-        }
-
-        // if rcv == 0 => no connection was detected
-        if (rcv > 0)
-        {
-
-            // Accept incoming connection
-            new_socket = accept (server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-
-            if (new_socket < 0)
-            {
-                perror ("accept");
-                int err = errno;
-                log.log ("Error ", std::strerror (err));
-                return -1;
-            }
-            return 0;
-        }
-    }
-    return 0;
-}
-
-/**
- * opens the driver and writes all commands
- * then read all commands and returns the result
- */
-std::string
-write_commands (const std::vector<char> &command, std::string device_name)
-{
-    std::string ret{ "" };
-    std::fstream fs;
-    fs.open (device_name, std::fstream::out);
-
-    if (!fs.is_open ())
-    {
-        throw std::runtime_error ("Error: onewire_driver is not open");
-    }
-
-    // write the command
-    for (char c : command)
-    {
-        fs.put (c);
-    }
-    fs.close ();
-
-    // wait some time
-    sleep (1);
-
-    fs.open (device_name, std::fstream::in);
-
-    // read the result
-    char c;
-    while (fs.get (c))
-    {
-        ret.push_back (c);
-    }
-    fs.close ();
-
-    return ret;
+    log.info ("Created TCP server");
+    log.info ("Server listening on port {}", PORT);
 }
 
 /**
@@ -226,10 +140,26 @@ demonize ()
     close (STDERR_FILENO);
 }
 
+/**
+ * Prints the arguments described at main
+ */
+void
+usage (const char *name)
+{
+    std::cerr << "usage: " << name
+              << " [-m | -r | -b <bits> [-p] | -s [period ms] [history file] | <commands>]"
+              << std::endl;
+}
+
 /**
  * Arguments:
+ * The single command modes use the first 1-Wire bus
  * -m: send the measure temperature command
  * -r: send a read scratchpad command
+ * -b <bits> [-p]: set the resolution to 9 to 12 bits, -p stores it in the EEPROM
+ * -s [period ms] [history file]: starts the TCP server on all 1-Wire buses, samples every
+ *    bus each period ms (0 disables) and stores the readings in the history file ("" disables),
+ *    bus N > 0 uses "<history file>.N"
  * [arg1 ]: Sends the command string to the 1-Wire driver
  * else: starts the TCP server
  */
@@ -241,28 +171,57 @@ main (int argc, char *argv[])
     signal (SIGTERM, handle_signal);
     signal (SIGINT, handle_signal);
 
-    std::unique_ptr<logger::LogCout> sink = std::make_unique<logger::LogCout> ();
+    // log records are written by a background thread, logging never blocks a request
+    std::unique_ptr<logger::LogAsync> sink
+        = std::make_unique<logger::LogAsync> (std::make_unique<logger::LogCout> ());
     logger::Logger log (std::move (sink));
 
+    std::vector<std::string> devices = server::DeviceSession::discover (DRIVER_PATH);
+    server::DeviceSession session (devices.front ());
+
     // parse the arguments
-    if (argc > 1)
+    if (argc > 1 && std::string (argv[1]).compare ("-s") != 0)
     {
         if (std::string (argv[1]).compare ("-m") == 0)
         { // measure temperature
-            log.log ("measure temp");
-            std::string s = write_commands ({ 'C', 'T' }, DRIVER_PATH);
-            log.log ("Got ", s);
+            log.info ("measure temp");
+            onewire_ioc_convert convert = {};
+            session.control (ONEWIRE_IOC_CONVERT, &convert);
+            log.info ("Converted in {} us status {}", convert.conversion_us, (int)convert.status);
         }
         else if (std::string (argv[1]).compare ("-r") == 0)
         { // read scratchpad
-            std::string s = write_commands ({ 'R', 'S' }, DRIVER_PATH);
-            log.log ("Got ", s);
+            onewire_ioc_scratchpad scratchpad = {};
+            session.control (ONEWIRE_IOC_READ_SCRATCHPAD, &scratchpad);
             std::ostringstream os;
-            for (size_t i = 0; i < s.size (); ++i)
+            for (size_t i = 0; i < sizeof (scratchpad.data); ++i)
+            {
+                os << std::hex << (int)scratchpad.data[i] << " ";
+            }
+            log.info ("Got 0x{} status {}", os.str (), (int)scratchpad.status);
+        }
+        else if (std::string (argv[1]).compare ("-b") == 0 && argc > 2)
+        { // set the resolution
+            int bits = 0;
+            try
+            {
+                bits = std::stoi (argv[2]);
+            }
+            catch (const std::exception &)
+            { // bits stays 0 and is rejected below
+            }
+            if (bits < ONEWIRE_RESOLUTION_MIN || bits > ONEWIRE_RESOLUTION_MAX)
             {
-                os << std::hex << (int)s[i] << " ";
+                usage (argv[0]);
+                return EXIT_FAILURE;
             }
-            log.log ("Got 0x", os.str ());
+
+            onewire_ioc_resolution resolution = {};
+            resolution.bits = (__u8)bits;
+            resolution.persist = argc > 3 && std::string (argv[3]).compare ("-p") == 0;
+            session.control (ONEWIRE_IOC_SET_RESOLUTION, &resolution);
+            log.info ("Resolution {} bit, conversion {} ms, status {}", (int)resolution.bits,
+                      resolution.conversion_ms, (int)resolution.status);
         }
         else
         { // write a chain of commands
@@ -272,7 +231,7 @@ main (int argc, char *argv[])
 
             if (argc > 2)
             {
-                log.log ("Warning only argv[1] is used all others are ignored");
+                log.warning ("Warning only argv[1] is used all others are ignored");
             }
 
             int k = 0;
@@ -284,69 +243,98 @@ main (int argc, char *argv[])
 
                 c = argv[1][++k];
             }
-            log.log ("converted ", stream.str ());
-            write_commands (char_arr, DRIVER_PATH);
+            log.info ("converted {}", stream.str ());
+            session.transact (char_arr);
         }
     }
     else
     {
-        log.log ("TCP server");
-
-        create_server (log);
+        log.info ("TCP server");
 
-        log.log ("Accept server");
-        while (!stop)
+        std::chrono::milliseconds sample_period (SAMPLE_PERIOD_MS);
+        if (argc > 2)
         {
-            int ret = wait_for_conenction (log);
-
-            if (stop || ret < 0)
-                break;
+            try
+            {
+                sample_period = std::chrono::milliseconds (std::stoll (argv[2]));
+            }
+            catch (const std::exception &)
+            {
+                sample_period = std::chrono::milliseconds (-1);
+            }
+            if (sample_period.count () < 0)
+            {
+                usage (argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
 
-            char client_ip[INET_ADDRSTRLEN];
-            inet_ntop (AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        std::string history_path = HISTORY_PATH;
+        if (argc > 3)
+        {
+            history_path = argv[3];
+        }
 
-            int client_port = ntohs (client_addr.sin_port);
-            log.log ("connection accepted at port ", client_port);
+        // one session, history, arbiter and sampler per bus, the buses run in parallel
+        std::vector<std::unique_ptr<server::DeviceSession>> sessions;
+        std::vector<std::unique_ptr<server::SeriesStore>> histories;
+        std::vector<std::unique_ptr<server::BusArbiter>> arbiters;
+        std::vector<std::unique_ptr<server::Sampler>> samplers;
+        std::vector<server::Reactor::Bus> buses;
 
-            char bufa[256];
-            const int buf_size = 256;
-            ssize_t bytes_read;
+        for (size_t i = 0; i < devices.size (); i++)
+        {
+            log.info ("Bus {} on {}", i, devices[i]);
 
-            while (!stop && (bytes_read = read (new_socket, bufa, buf_size - 1)))
+            std::unique_ptr<server::SeriesStore> history;
+            if (!history_path.empty ())
             {
-
-                log.log ("Reading...");
-                if (bytes_read > 0)
+                std::string path = i == 0 ? history_path : history_path + "." + std::to_string (i);
+                try
                 {
-                    bufa[bytes_read] = '\0';
+                    history = std::make_unique<server::SeriesStore> (path);
+                    log.info ("History in {}", path);
                 }
-                else if (bytes_read == 0)
+                catch (const std::exception &e)
                 {
-                    log.log ("Closing connection");
-                    break;
+                    log.error ("No history: {}", e.what ());
                 }
-                else
-                {
-                    throw std::runtime_error ("Error reading buffer got "
-                                              + std::to_string (bytes_read));
-                }
-                std::string buf;
+            }
 
-                for (int i = 0; i < bytes_read; i++)
-                {
-                    buf.push_back (bufa[i]);
-                }
+            auto &device = *sessions.emplace_back (
+                std::make_unique<server::DeviceSession> (devices[i]));
+            auto &arbiter = *arbiters.emplace_back (std::make_unique<server::BusArbiter> (log));
+            auto &sampler = *samplers.emplace_back (std::make_unique<server::Sampler> (
+                log, arbiter, device, sample_period, history.get ()));
+
+            // only ever called on the arbiter thread of the bus
+            auto transaction
+                = [&device] (const std::vector<char> &command) { return device.transact (command); };
 
-                log.log ("Got ", bytes_read, " ", buf);
-                std::vector<char> char_arr = convert_to_bvec (buf);
+            buses.push_back ({ arbiter, sampler, history.get (), transaction });
+            histories.push_back (std::move (history));
+        }
 
-                std::string s = write_commands (char_arr, "/dev/onewire_dev");
+        create_server (log);
 
-                log.log ("send string", s);
-                write (new_socket, s.c_str (), s.length ());
-            }
-            close (new_socket);
-            log.log ("socket closed");
+        server::Reactor reactor (log, server_fd, std::move (buses));
+
+        log.info ("Sampling every {} ms", sample_period.count ());
+        for (auto &sampler : samplers)
+        {
+            sampler->start ();
+        }
+
+        log.info ("Accept server");
+        reactor.run (stop);
+
+        for (auto &sampler : samplers)
+        {
+            sampler->shutdown ();
+        }
+        for (auto &arbiter : arbiters)
+        {
+            arbiter->shutdown ();
         }
         close (server_fd);
     }
@@ -0,0 +1,83 @@
+#include "protocol.h"
+
+using namespace protocol;
+
+void
+protocol::put_u32 (std::string &out, uint32_t v)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        out.push_back ((char)((v >> shift) & 0xFF));
+    }
+}
+
+void
+protocol::put_u64 (std::string &out, uint64_t v)
+{
+    put_u32 (out, (uint32_t)(v >> 32));
+    put_u32 (out, (uint32_t)v);
+}
+
+uint32_t
+protocol::get_u32 (const char *p)
+{
+    const uint8_t *b = (const uint8_t *)p;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+uint64_t
+protocol::get_u64 (const char *p)
+{
+    return ((uint64_t)get_u32 (p) << 32) | get_u32 (p + 4);
+}
+
+/**
+ * Removes the first complete frame from buffer
+ * returns nothing if the buffer does not hold a complete frame yet
+ */
+std::optional<Frame>
+protocol::take_frame (std::string &buffer)
+{
+    if (buffer.size () < header_size)
+    {
+        return std::nullopt;
+    }
+
+    uint32_t length = get_u32 (buffer.data () + 8);
+    if (length > max_payload)
+    {
+        throw FramingError ("frame payload too large " + std::to_string (length));
+    }
+    if (buffer.size () < header_size + length)
+    {
+        return std::nullopt;
+    }
+
+    Frame frame;
+    frame.version = (uint8_t)buffer[0];
+    frame.opcode = (Opcode)buffer[1];
+    frame.status = (Status)buffer[2];
+    frame.bus = (uint8_t)buffer[3];
+    frame.request_id = get_u32 (buffer.data () + 4);
+    frame.payload = buffer.substr (header_size, length);
+
+    buffer.erase (0, header_size + length);
+    return frame;
+}
+
+std::string
+protocol::encode (const Frame &frame)
+{
+    std::string out;
+    out.reserve (header_size + frame.payload.size ());
+
+    out.push_back ((char)frame.version);
+    out.push_back ((char)frame.opcode);
+    out.push_back ((char)frame.status);
+    out.push_back ((char)frame.bus);
+    put_u32 (out, frame.request_id);
+    put_u32 (out, (uint32_t)frame.payload.size ());
+    out.append (frame.payload);
+
+    return out;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Binary framing of the tcp-server protocol
+ *
+ * A client selects the binary protocol by sending negotiation_byte as the
+ * very first byte of a connection, the server answers with negotiation_byte
+ * and its version. Any other first byte keeps the legacy text protocol.
+ *
+ * Every frame is a 12 byte header followed by length payload bytes,
+ * all integers are big endian:
+ *   u8 version | u8 opcode | u8 status | u8 bus | u32 request_id | u32 length
+ * bus selects the 1-Wire bus, 0 is the first discovered one. The response
+ * carries the request_id and bus of its request, responses of different
+ * requests may arrive in any order.
+ */
+namespace protocol
+{
+
+constexpr uint8_t negotiation_byte = 0xB1; // never part of a legacy text command
+constexpr uint8_t version = 1;
+
+constexpr size_t header_size = 12;
+constexpr uint32_t max_payload = 4096;
+
+enum class Opcode : uint8_t
+{
+    ping = 0,        // echoes the payload
+    command = 1,     // payload is a legacy text command, response is the raw driver result
+    temperature = 2, // optional u32 max age ms, response i32 milli celsius | u64 unix time ms
+    history = 3,     // u64 from | u64 to unix time ms, response n * (u64 unix time ms | i32 milli celsius)
+};
+
+enum class Status : uint8_t
+{
+    ok = 0,
+    bad_version = 1,
+    bad_opcode = 2,
+    bad_payload = 3,
+    no_data = 4,
+    bad_bus = 5, // no 1-Wire bus with that number
+};
+
+struct Frame
+{
+    uint8_t version = protocol::version;
+    Opcode opcode = Opcode::ping;
+    Status status = Status::ok;
+    uint8_t bus = 0;
+    uint32_t request_id = 0;
+    std::string payload;
+};
+
+/**
+ * Thrown when the byte stream can not be a valid frame sequence
+ */
+struct FramingError : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+std::optional<Frame> take_frame (std::string &buffer);
+std::string encode (const Frame &frame);
+
+void put_u32 (std::string &out, uint32_t v);
+void put_u64 (std::string &out, uint64_t v);
+uint32_t get_u32 (const char *p);
+uint64_t get_u64 (const char *p);
+
+}
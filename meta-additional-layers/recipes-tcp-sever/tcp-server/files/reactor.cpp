@@ -0,0 +1,581 @@
+#include "reactor.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace server;
+
+// epoll keys of the fixed descriptors, the arbiter of bus i has key_arbiter + i,
+// client ids start after the last arbiter
+static constexpr uint64_t key_server = BusArbiter::no_connection;
+static constexpr uint64_t key_arbiter = 1;
+
+static constexpr int max_events = 64;
+static constexpr int read_chunk = 256;
+
+Reactor::Reactor (logger::Logger &log, int server_fd, std::vector<Bus> buses)
+    : log_ (log), server_fd_ (server_fd), buses_ (std::move (buses)),
+      next_id_ (key_arbiter + buses_.size ())
+{
+    if (buses_.empty ())
+    {
+        throw std::runtime_error ("Reactor without a 1-Wire bus");
+    }
+
+    epoll_fd_ = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+    {
+        throw std::runtime_error ("Error creating epoll " + std::string (std::strerror (errno)));
+    }
+
+    fcntl (server_fd_, F_SETFL, fcntl (server_fd_, F_GETFL) | O_NONBLOCK);
+    add_fd (server_fd_, key_server, EPOLLIN);
+    for (size_t i = 0; i < buses_.size (); i++)
+    {
+        add_fd (buses_[i].arbiter.event_fd (), key_arbiter + i, EPOLLIN);
+    }
+}
+
+Reactor::~Reactor ()
+{
+    for (auto &[id, conn] : connections_)
+    {
+        close (conn.fd);
+    }
+    close (epoll_fd_);
+}
+
+void
+Reactor::add_fd (int fd, uint64_t key, uint32_t events)
+{
+    struct epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = key;
+    if (epoll_ctl (epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        throw std::runtime_error ("Error adding fd to epoll " + std::string (std::strerror (errno)));
+    }
+}
+
+/**
+ * Runs until stop is set by the signal handler
+ * epoll_wait times out regularly so SIGTERM is noticed within 300 ms
+ */
+void
+Reactor::run (volatile sig_atomic_t &stop)
+{
+    struct epoll_event events[max_events];
+
+    while (!stop)
+    {
+        int n = epoll_wait (epoll_fd_, events, max_events, 300); // 300ms
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_.error ("Error epoll_wait {}", std::strerror (errno));
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t key = events[i].data.u64;
+
+            if (key == key_server)
+            {
+                accept_clients ();
+            }
+            else if (key < key_arbiter + buses_.size ())
+            {
+                dispatch_results (buses_[key - key_arbiter]);
+            }
+            else
+            {
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    close_client (key);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN)
+                {
+                    read_client (key);
+                }
+                if ((events[i].events & EPOLLOUT) && connections_.count (key))
+                {
+                    flush_client (key);
+                }
+            }
+        }
+    }
+}
+
+void
+Reactor::accept_clients ()
+{
+    while (true)
+    {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof (client_addr);
+
+        int fd = accept4 (server_fd_, (struct sockaddr *)&client_addr, &client_addr_len,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                log_.error ("Error accept {}", std::strerror (errno));
+            }
+            return;
+        }
+
+        uint64_t id = next_id_++;
+        int client_port = ntohs (client_addr.sin_port);
+
+        // out of epoll resources only this client is refused, the server keeps running
+        try
+        {
+            add_fd (fd, id, EPOLLIN);
+        }
+        catch (const std::runtime_error &e)
+        {
+            log_.error ("Refusing connection at port {}: {}", client_port, e.what ());
+            close (fd);
+            continue;
+        }
+        connections_[id] = Connection{ fd, client_port, Mode::undecided, "", "" };
+
+        log_.info ("connection accepted at port {}", client_port);
+    }
+}
+
+/**
+ * Reads what the client sent
+ * The first byte selects the protocol, in legacy mode every read chunk is one
+ * command, in binary mode the bytes are collected until a frame is complete
+ */
+void
+Reactor::read_client (uint64_t id)
+{
+    char bufa[read_chunk];
+
+    while (true)
+    {
+        auto it = connections_.find (id);
+        if (it == connections_.end ())
+        {
+            return;
+        }
+        Connection &conn = it->second;
+
+        ssize_t bytes_read = read (conn.fd, bufa, sizeof (bufa));
+
+        if (bytes_read == 0)
+        {
+            log_.info ("Closing connection");
+            close_client (id);
+            return;
+        }
+        if (bytes_read < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                log_.error ("Error reading buffer {}", std::strerror (errno));
+                close_client (id);
+            }
+            return;
+        }
+
+        const char *data = bufa;
+        if (conn.mode == Mode::undecided)
+        {
+            if ((uint8_t)bufa[0] == protocol::negotiation_byte)
+            {
+                log_.info ("binary protocol on port {}", conn.port);
+                conn.mode = Mode::binary;
+                data++;
+                bytes_read--;
+                send_to (id, { (char)protocol::negotiation_byte, (char)protocol::version });
+                if (connections_.find (id) == connections_.end ())
+                {
+                    return;
+                }
+            }
+            else
+            {
+                conn.mode = Mode::legacy;
+            }
+        }
+
+        if (conn.mode == Mode::binary)
+        {
+            conn.in.append (data, bytes_read);
+            handle_frames (id);
+        }
+        else
+        {
+            handle_text (id, std::vector<char> (data, data + bytes_read));
+        }
+    }
+}
+
+/**
+ * Legacy text protocol, the whole chunk is one command
+ * An "@<bus> " prefix selects the 1-Wire bus, without it the first one is used
+ */
+void
+Reactor::handle_text (uint64_t id, const std::vector<char> &chunk)
+{
+    std::string text (chunk.begin (), chunk.end ());
+    log_.debug ("Got {} {}", chunk.size (), text);
+
+    size_t bus_index = 0;
+    if (!text.empty () && text[0] == '@')
+    {
+        size_t end = text.find (' ');
+        try
+        {
+            bus_index = std::stoul (text.substr (1, end - 1));
+        }
+        catch (const std::exception &)
+        {
+            bus_index = buses_.size ();
+        }
+        if (end == std::string::npos || bus_index >= buses_.size ())
+        {
+            send_to (id, "ERR bus");
+            return;
+        }
+        text.erase (0, end + 1);
+    }
+    Bus &bus = buses_[bus_index];
+    std::vector<char> command (text.begin (), text.end ());
+
+    if (text.compare (0, 4, "TEMP") == 0)
+    {
+        std::optional<std::chrono::milliseconds> max_age;
+        try
+        {
+            if (text.size () > 4)
+            {
+                max_age = std::chrono::milliseconds (std::stoll (text.substr (4)));
+            }
+        }
+        catch (const std::exception &)
+        {
+            send_to (id, "ERR max age");
+            return;
+        }
+        request_temperature (id, bus, max_age, Sampler::format);
+        return;
+    }
+
+    if (text.compare (0, 4, "HIST") == 0)
+    {
+        // "HIST <from> <to>" in unix ms, one "<unix ms> <celsius>" line per sample
+        long long from_ms, to_ms;
+        if (std::sscanf (text.c_str () + 4, "%lld %lld", &from_ms, &to_ms) != 2)
+        {
+            send_to (id, "ERR range");
+            return;
+        }
+
+        // weeks of history take a while, the reply is built on the arbiter thread
+        bus.arbiter.submit (id, [&bus, from_ms, to_ms] {
+            std::optional<std::vector<Sample>> samples = history_range (bus, from_ms, to_ms);
+            if (!samples)
+            {
+                return std::string ("ERR no history");
+            }
+
+            std::string out;
+            char line[48];
+            for (const Sample &sample : *samples)
+            {
+                int n = std::snprintf (line, sizeof (line), "%lld %.4f\n",
+                                       (long long)sample.time_ms, sample.value / 16.0);
+                out.append (line, n);
+            }
+            out.append ("END\n");
+            return out;
+        });
+        return;
+    }
+
+    bus.arbiter.submit (id, [&bus, command] { return bus.handler (command); });
+}
+
+/**
+ * Binary protocol, handles every complete frame in the input buffer
+ */
+void
+Reactor::handle_frames (uint64_t id)
+{
+    while (true)
+    {
+        auto it = connections_.find (id);
+        if (it == connections_.end ())
+        {
+            return;
+        }
+
+        std::optional<protocol::Frame> frame;
+        try
+        {
+            frame = protocol::take_frame (it->second.in);
+        }
+        catch (const protocol::FramingError &e)
+        {
+            log_.warning ("Protocol error {}", e.what ());
+            close_client (id);
+            return;
+        }
+
+        if (!frame)
+        {
+            return;
+        }
+        handle_frame (id, *frame);
+    }
+}
+
+/**
+ * Encodes a temperature response, status no_data if there is no reading
+ */
+static std::string
+encode_temperature (protocol::Frame response, const std::optional<Reading> &reading)
+{
+    if (!reading)
+    {
+        response.status = protocol::Status::no_data;
+        return protocol::encode (response);
+    }
+
+    auto unix_ms = std::chrono::duration_cast<std::chrono::milliseconds> (
+        reading->taken.time_since_epoch ());
+
+    protocol::put_u32 (response.payload, (uint32_t)(int32_t)(reading->raw * 1000 / 16));
+    protocol::put_u64 (response.payload, (uint64_t)unix_ms.count ());
+    return protocol::encode (response);
+}
+
+void
+Reactor::handle_frame (uint64_t id, const protocol::Frame &request)
+{
+    protocol::Frame response;
+    response.opcode = request.opcode;
+    response.request_id = request.request_id;
+    response.bus = request.bus;
+
+    if (request.version != protocol::version)
+    {
+        response.status = protocol::Status::bad_version;
+        send_to (id, protocol::encode (response));
+        return;
+    }
+    if (request.bus >= buses_.size ())
+    {
+        response.status = protocol::Status::bad_bus;
+        send_to (id, protocol::encode (response));
+        return;
+    }
+    Bus &bus = buses_[request.bus];
+
+    switch (request.opcode)
+    {
+    case protocol::Opcode::ping:
+        response.payload = request.payload;
+        send_to (id, protocol::encode (response));
+        break;
+
+    case protocol::Opcode::command:
+    {
+        std::vector<char> command (request.payload.begin (), request.payload.end ());
+        bus.arbiter.submit (id, [&bus, response, command] () mutable {
+            response.payload = bus.handler (command);
+            return protocol::encode (response);
+        });
+        break;
+    }
+
+    case protocol::Opcode::temperature:
+    {
+        std::optional<std::chrono::milliseconds> max_age;
+        if (request.payload.size () == 4)
+        {
+            max_age = std::chrono::milliseconds (protocol::get_u32 (request.payload.data ()));
+        }
+        else if (!request.payload.empty ())
+        {
+            response.status = protocol::Status::bad_payload;
+            send_to (id, protocol::encode (response));
+            break;
+        }
+        request_temperature (id, bus, max_age, [response] (const std::optional<Reading> &reading) {
+            return encode_temperature (response, reading);
+        });
+        break;
+    }
+
+    case protocol::Opcode::history:
+    {
+        if (request.payload.size () != 16)
+        {
+            response.status = protocol::Status::bad_payload;
+            send_to (id, protocol::encode (response));
+            break;
+        }
+
+        int64_t from_ms = (int64_t)protocol::get_u64 (request.payload.data ());
+        int64_t to_ms = (int64_t)protocol::get_u64 (request.payload.data () + 8);
+        bus.arbiter.submit (id, [&bus, response, from_ms, to_ms] () mutable {
+            std::optional<std::vector<Sample>> samples = history_range (bus, from_ms, to_ms);
+            if (!samples)
+            {
+                response.status = protocol::Status::no_data;
+                return protocol::encode (response);
+            }
+
+            response.payload.reserve (samples->size () * 12);
+            for (const Sample &sample : *samples)
+            {
+                protocol::put_u64 (response.payload, (uint64_t)sample.time_ms);
+                protocol::put_u32 (response.payload,
+                                   (uint32_t)(int32_t)(sample.value * 1000 / 16));
+            }
+            return protocol::encode (response);
+        });
+        break;
+    }
+
+    default:
+        response.status = protocol::Status::bad_opcode;
+        send_to (id, protocol::encode (response));
+        break;
+    }
+}
+
+/**
+ * Answers from the cache if the cached reading is young enough,
+ * otherwise queues a fresh sample on the arbiter
+ */
+void
+Reactor::request_temperature (uint64_t id, Bus &bus,
+                              std::optional<std::chrono::milliseconds> max_age,
+                              ReadingFormatter format)
+{
+    auto now = std::chrono::steady_clock::now ();
+    std::optional<Reading> reading = bus.sampler.latest ();
+
+    if (reading && (!max_age || now - reading->taken_steady <= *max_age))
+    {
+        send_to (id, format (reading));
+        return;
+    }
+
+    // a reading taken after now - max_age satisfies the request
+    auto since = max_age ? now - *max_age : now;
+    bus.arbiter.submit (id, [&bus, since, format] {
+        return format (bus.sampler.reading_since (since));
+    });
+}
+
+/**
+ * Reads a time range from the history store, nothing if there is no store
+ * Runs on the arbiter thread of the bus, like the sampler appending to the store
+ */
+std::optional<std::vector<Sample>>
+Reactor::history_range (Bus &bus, int64_t from_ms, int64_t to_ms)
+{
+    if (!bus.history)
+    {
+        return std::nullopt;
+    }
+    return bus.history->range (from_ms, to_ms);
+}
+
+/**
+ * Queues data for the client and tries to send it right away
+ */
+void
+Reactor::send_to (uint64_t id, const std::string &data)
+{
+    auto it = connections_.find (id);
+    if (it == connections_.end ())
+    {
+        return;
+    }
+    it->second.out.append (data);
+    flush_client (id);
+}
+
+/**
+ * Writes as much of the pending output as the socket accepts
+ */
+void
+Reactor::flush_client (uint64_t id)
+{
+    Connection &conn = connections_.at (id);
+
+    while (!conn.out.empty ())
+    {
+        ssize_t sent = send (conn.fd, conn.out.data (), conn.out.size (), MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            log_.error ("Error sending {}", std::strerror (errno));
+            close_client (id);
+            return;
+        }
+        conn.out.erase (0, sent);
+    }
+
+    struct epoll_event ev{};
+    ev.events = conn.out.empty () ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    ev.data.u64 = id;
+    epoll_ctl (epoll_fd_, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+/**
+ * Hands finished bus results to their connections
+ * results of connections that are already closed are dropped
+ */
+void
+Reactor::dispatch_results (Bus &bus)
+{
+    for (BusResult &result : bus.arbiter.take_results ())
+    {
+        auto it = connections_.find (result.connection);
+        if (it == connections_.end ())
+        {
+            continue;
+        }
+
+        log_.debug ("send string {}", result.data);
+        send_to (result.connection, result.data);
+    }
+}
+
+void
+Reactor::close_client (uint64_t id)
+{
+    auto it = connections_.find (id);
+    if (it == connections_.end ())
+    {
+        return;
+    }
+
+    epoll_ctl (epoll_fd_, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    close (it->second.fd);
+    log_.info ("socket closed port {}", it->second.port);
+    connections_.erase (it);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <csignal>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bus_arbiter.h"
+#include "logger.h"
+#include "protocol.h"
+#include "sampler.h"
+#include "series_store.h"
+
+namespace server
+{
+
+/**
+ * epoll based event loop serving many TCP clients at once
+ * In the legacy text protocol every chunk a client sends is one command, in
+ * the binary protocol (see protocol.h) every frame is one request. Commands
+ * are handed to the BusArbiter and the result is written back once the
+ * arbiter reports it. Temperature requests are answered from the Sampler
+ * cache and only go to the bus when the cached reading is too old, history
+ * requests are answered from the SeriesStore on the arbiter thread, so a long
+ * range never stalls the event loop.
+ * Every 1-Wire bus has its own arbiter, sampler and store, so the buses are
+ * used in parallel. Requests select the bus, the first one by default.
+ */
+class Reactor
+{
+  public:
+    using CommandHandler = std::function<std::string (const std::vector<char> &)>;
+
+    /**
+     * Everything serving one 1-Wire bus
+     */
+    struct Bus
+    {
+        BusArbiter &arbiter;
+        Sampler &sampler;
+        SeriesStore *history;
+        CommandHandler handler;
+    };
+
+    Reactor (logger::Logger &log, int server_fd, std::vector<Bus> buses);
+    ~Reactor ();
+
+    Reactor (const Reactor &) = delete;
+    Reactor &operator= (const Reactor &) = delete;
+
+    void run (volatile sig_atomic_t &stop);
+
+  private:
+    using ReadingFormatter = std::function<std::string (const std::optional<Reading> &)>;
+
+    enum class Mode
+    {
+        undecided, // nothing received yet
+        legacy,
+        binary,
+    };
+
+    struct Connection
+    {
+        int fd;
+        int port;
+        Mode mode;
+        std::string in;
+        std::string out;
+    };
+
+    void add_fd (int fd, uint64_t key, uint32_t events);
+    void accept_clients ();
+    void read_client (uint64_t id);
+    void handle_text (uint64_t id, const std::vector<char> &chunk);
+    void handle_frames (uint64_t id);
+    void handle_frame (uint64_t id, const protocol::Frame &request);
+    void request_temperature (uint64_t id, Bus &bus,
+                              std::optional<std::chrono::milliseconds> max_age,
+                              ReadingFormatter format);
+    static std::optional<std::vector<Sample>> history_range (Bus &bus, int64_t from_ms,
+                                                             int64_t to_ms);
+    void send_to (uint64_t id, const std::string &data);
+    void flush_client (uint64_t id);
+    void dispatch_results (Bus &bus);
+    void close_client (uint64_t id);
+
+    logger::Logger &log_;
+    int server_fd_;
+    int epoll_fd_;
+    std::vector<Bus> buses_;
+
+    uint64_t next_id_;
+    std::unordered_map<uint64_t, Connection> connections_;
+};
+
+}
@@ -0,0 +1,160 @@
+#include "sampler.h"
+
+#include <cstdio>
+
+#include "constants.h"
+
+using namespace server;
+
+Sampler::Sampler (logger::Logger &log, BusArbiter &arbiter, DeviceSession &device,
+                  std::chrono::milliseconds period, SeriesStore *history)
+    : log_ (log), arbiter_ (arbiter), device_ (device), period_ (period), history_ (history)
+{
+}
+
+Sampler::~Sampler () { shutdown (); }
+
+/**
+ * Starts the sampling thread, a period of 0 disables background sampling
+ */
+void
+Sampler::start ()
+{
+    if (period_.count () > 0)
+    {
+        worker_ = std::thread (&Sampler::run, this);
+    }
+}
+
+void
+Sampler::shutdown ()
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one ();
+
+    if (worker_.joinable ())
+    {
+        worker_.join ();
+    }
+}
+
+std::optional<Reading>
+Sampler::latest () const
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    return latest_;
+}
+
+/**
+ * Returns a reading taken at or after since, sampling the bus if needed
+ * Must run on the arbiter thread. Requests that queued up while a sample was
+ * running are served from that sample instead of starting another one.
+ */
+std::optional<Reading>
+Sampler::reading_since (std::chrono::steady_clock::time_point since)
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex_);
+        if (latest_ && latest_->taken_steady >= since)
+        {
+            return latest_;
+        }
+    }
+    return sample ();
+}
+
+/**
+ * Formats a reading as "<degree celsius> <age in ms>"
+ */
+std::string
+Sampler::format (const std::optional<Reading> &reading)
+{
+    if (!reading)
+    {
+        return "ERR no reading";
+    }
+
+    auto age = std::chrono::duration_cast<std::chrono::milliseconds> (
+        std::chrono::steady_clock::now () - reading->taken_steady);
+
+    char buf[64];
+    std::snprintf (buf, sizeof (buf), "%.4f %lld", reading->celsius, (long long)age.count ());
+    return buf;
+}
+
+/**
+ * Runs convert and read scratchpad and updates the cache
+ * Must run on the arbiter thread
+ */
+std::optional<Reading>
+Sampler::sample ()
+{
+    onewire_ioc_convert convert = {};
+    onewire_ioc_scratchpad scratchpad = {};
+    try
+    {
+        // skip ROM, the sampler reads the only sensor on the bus
+        device_.control (ONEWIRE_IOC_CONVERT, &convert);
+        device_.control (ONEWIRE_IOC_READ_SCRATCHPAD, &scratchpad);
+    }
+    catch (const std::exception &e)
+    {
+        log_.warning ("Sampler failed: {}", e.what ());
+        return std::nullopt;
+    }
+
+    if (convert.status != ONEWIRE_STATUS_OK)
+    {
+        log_.warning ("Sampler conversion failed with status {}", (int)convert.status);
+        return std::nullopt;
+    }
+    if (scratchpad.status != ONEWIRE_STATUS_OK)
+    {
+        log_.warning ("Sampler got a scratchpad with status {}", (int)scratchpad.status);
+        return std::nullopt;
+    }
+
+    Reading reading;
+    reading.raw = (int16_t)((scratchpad.data[1] << 8) | scratchpad.data[0]);
+    // below 12 bit the low bits of the temperature are undefined
+    int bits = ONEWIRE_RESOLUTION_MIN + ((scratchpad.data[4] >> 5) & 0x3);
+    reading.raw &= ~((1 << (ONEWIRE_RESOLUTION_MAX - bits)) - 1);
+    reading.celsius = reading.raw / 16.0;
+    reading.taken = std::chrono::system_clock::now ();
+    reading.taken_steady = std::chrono::steady_clock::now ();
+
+    if (history_)
+    {
+        auto unix_ms = std::chrono::duration_cast<std::chrono::milliseconds> (
+            reading.taken.time_since_epoch ());
+        history_->append (unix_ms.count (), reading.raw);
+    }
+
+    std::lock_guard<std::mutex> lock (mutex_);
+    latest_ = reading;
+    return latest_;
+}
+
+void
+Sampler::run ()
+{
+    std::unique_lock<std::mutex> lock (mutex_);
+
+    while (!stopping_)
+    {
+        // only one background sample in the arbiter queue at a time
+        if (!pending_.exchange (true))
+        {
+            arbiter_.submit (BusArbiter::no_connection, [this] {
+                sample ();
+                pending_ = false;
+                return std::string ();
+            });
+        }
+
+        cv_.wait_for (lock, period_, [this] { return stopping_; });
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "bus_arbiter.h"
+#include "device_session.h"
+#include "logger.h"
+#include "series_store.h"
+
+namespace server
+{
+
+/**
+ * One decoded DS18B20 temperature reading
+ */
+struct Reading
+{
+    int16_t raw;    // scratchpad byte 0 and 1, 1/16 degree celsius
+    double celsius;
+    std::chrono::system_clock::time_point taken;
+    std::chrono::steady_clock::time_point taken_steady;
+};
+
+/**
+ * Samples the sensor in the background and caches the latest reading
+ * The bus transactions (convert, read scratchpad ioctls) run on the
+ * BusArbiter like every other device command, so clients reading the cache
+ * never touch the bus.
+ * Every reading is also appended to the history store if there is one.
+ */
+class Sampler
+{
+  public:
+    Sampler (logger::Logger &log, BusArbiter &arbiter, DeviceSession &device,
+             std::chrono::milliseconds period, SeriesStore *history);
+    ~Sampler ();
+
+    Sampler (const Sampler &) = delete;
+    Sampler &operator= (const Sampler &) = delete;
+
+    void start ();
+    void shutdown ();
+
+    std::optional<Reading> latest () const;
+    std::optional<Reading> reading_since (std::chrono::steady_clock::time_point since);
+
+    static std::string format (const std::optional<Reading> &reading);
+
+  private:
+    std::optional<Reading> sample ();
+    void run ();
+
+    logger::Logger &log_;
+    BusArbiter &arbiter_;
+    DeviceSession &device_;
+    std::chrono::milliseconds period_;
+    SeriesStore *history_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::optional<Reading> latest_;
+    bool stopping_ = false;
+    std::atomic<bool> pending_{ false };
+
+    std::thread worker_;
+};
+
+}
@@ -0,0 +1,411 @@
+#include "series_store.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace server;
+
+namespace
+{
+
+constexpr char series_magic[8] = { 'O', 'W', 'S', 'E', 'R', 'I', 'E', 'S' };
+constexpr uint32_t series_version = 1;
+
+struct FileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t block_count; // blocks in use, the last one is the one being appended to
+};
+
+struct BlockHeader
+{
+    int64_t first_time;
+    int64_t last_time;
+    int32_t first_value;
+    uint32_t count; // samples in this block
+    uint32_t used;  // encoded bytes after the header
+    uint32_t reserved;
+};
+
+constexpr size_t data_capacity = SeriesStore::block_size - sizeof (BlockHeader);
+
+FileHeader *
+file_header (uint8_t *base)
+{
+    return (FileHeader *)base;
+}
+
+BlockHeader *
+block_header (uint8_t *block)
+{
+    return (BlockHeader *)block;
+}
+
+uint64_t
+zigzag (int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t
+unzigzag (uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+size_t
+put_varint (uint8_t *out, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80)
+    {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+/**
+ * returns false if the varint runs past end
+ */
+bool
+get_varint (const uint8_t *&p, const uint8_t *end, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Decodes all samples of a block, calls f (time_ms, value, delta) for each
+ */
+template <typename F>
+void
+decode_block (const BlockHeader *h, F f)
+{
+    const uint8_t *p = (const uint8_t *)(h + 1);
+    const uint8_t *end = p + std::min<size_t> (h->used, data_capacity);
+
+    int64_t time = h->first_time;
+    int32_t value = h->first_value;
+    int64_t delta = 0;
+
+    f (time, value, delta);
+    for (uint32_t i = 1; i < h->count; i++)
+    {
+        uint64_t dod, dv;
+        if (!get_varint (p, end, dod) || !get_varint (p, end, dv))
+        {
+            return;
+        }
+        delta += unzigzag (dod);
+        time += delta;
+        value += (int32_t)unzigzag (dv);
+        f (time, value, delta);
+    }
+}
+
+}
+
+SeriesStore::SeriesStore (const std::string &path)
+    : path_ (path), page_size_ (sysconf (_SC_PAGESIZE))
+{
+    fd_ = open (path.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+    {
+        throw std::runtime_error ("Error opening " + path + " " + std::strerror (errno));
+    }
+
+    struct stat st;
+    if (fstat (fd_, &st) < 0)
+    {
+        close (fd_);
+        throw std::runtime_error ("Error stat " + path + " " + std::strerror (errno));
+    }
+
+    if (st.st_size == 0)
+    { // new file
+        size_t size = (size_t)(1 + grow_blocks) * block_size;
+        if (ftruncate (fd_, size) < 0)
+        {
+            close (fd_);
+            throw std::runtime_error ("Error resizing " + path + " " + std::strerror (errno));
+        }
+        map (size);
+
+        FileHeader *h = file_header (base_);
+        std::memcpy (h->magic, series_magic, sizeof (series_magic));
+        h->version = series_version;
+        h->block_size = block_size;
+        h->block_count = 0;
+        return;
+    }
+
+    map (st.st_size);
+
+    FileHeader *h = file_header (base_);
+    if (mapped_ < 2 * block_size || std::memcmp (h->magic, series_magic, sizeof (series_magic))
+        || h->version != series_version || h->block_size != block_size
+        || h->block_count > block_capacity ())
+    {
+        munmap (base_, mapped_);
+        close (fd_);
+        throw std::runtime_error ("Error " + path + " is not a series file");
+    }
+
+    recover ();
+}
+
+SeriesStore::~SeriesStore ()
+{
+    if (base_)
+    {
+        msync (base_, mapped_, MS_SYNC);
+        munmap (base_, mapped_);
+    }
+    if (fd_ >= 0)
+    {
+        close (fd_);
+    }
+}
+
+void
+SeriesStore::map (size_t size)
+{
+    void *p = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED)
+    {
+        close (fd_);
+        throw std::runtime_error ("Error mapping " + path_ + " " + std::strerror (errno));
+    }
+    base_ = (uint8_t *)p;
+    mapped_ = size;
+}
+
+uint8_t *
+SeriesStore::block (uint64_t index) const
+{
+    return base_ + (index + 1) * block_size;
+}
+
+uint64_t
+SeriesStore::block_count () const
+{
+    return file_header (base_)->block_count;
+}
+
+uint64_t
+SeriesStore::block_capacity () const
+{
+    return mapped_ / block_size - 1;
+}
+
+/**
+ * Extends the file by grow_blocks and remaps it
+ */
+void
+SeriesStore::grow ()
+{
+    size_t size = mapped_ + (size_t)grow_blocks * block_size;
+    if (ftruncate (fd_, size) < 0)
+    {
+        throw std::runtime_error ("Error resizing " + path_ + " " + std::strerror (errno));
+    }
+
+    void *p = mremap (base_, mapped_, size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+    {
+        throw std::runtime_error ("Error remapping " + path_ + " " + std::strerror (errno));
+    }
+    base_ = (uint8_t *)p;
+    mapped_ = size;
+}
+
+/**
+ * Writes a full block back asynchronously, msync wants page aligned ranges
+ */
+void
+SeriesStore::sync_block (uint8_t *block) const
+{
+    uintptr_t start = (uintptr_t)block & ~(uintptr_t)(page_size_ - 1);
+    msync ((void *)start, (uintptr_t)block + block_size - start, MS_ASYNC);
+}
+
+/**
+ * Restores the encoder state from the last block after a restart
+ */
+void
+SeriesStore::recover ()
+{
+    if (block_count () == 0)
+    {
+        return;
+    }
+
+    for (uint64_t i = 1; i < block_count (); i++)
+    {
+        if (block_header (block (i))->first_time < block_header (block (i - 1))->last_time)
+        {
+            ordered_ = false;
+            break;
+        }
+    }
+
+    decode_block (block_header (block (block_count () - 1)),
+                  [this] (int64_t time, int32_t value, int64_t delta) {
+                      prev_time_ = time;
+                      prev_value_ = value;
+                      prev_delta_ = delta;
+                  });
+}
+
+void
+SeriesStore::start_block (int64_t time_ms, int32_t value)
+{
+    if (block_count () == block_capacity ())
+    {
+        grow ();
+    }
+
+    if (block_count () > 0 && time_ms < block_header (block (block_count () - 1))->last_time)
+    {
+        ordered_ = false;
+    }
+
+    BlockHeader *b = block_header (block (block_count ()));
+    b->first_time = time_ms;
+    b->last_time = time_ms;
+    b->first_value = value;
+    b->count = 1;
+    b->used = 0;
+    b->reserved = 0;
+
+    // publish the block only after it is initialized
+    file_header (base_)->block_count++;
+
+    prev_time_ = time_ms;
+    prev_delta_ = 0;
+    prev_value_ = value;
+}
+
+/**
+ * Appends one sample, a timestamp before the previous one starts a new block
+ */
+void
+SeriesStore::append (int64_t time_ms, int32_t value)
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+
+    if (block_count () == 0)
+    {
+        start_block (time_ms, value);
+        return;
+    }
+
+    uint8_t *current = block (block_count () - 1);
+    BlockHeader *b = block_header (current);
+
+    if (time_ms < prev_time_)
+    {
+        // the clock stepped back, keep every block's time span valid
+        sync_block (current);
+        start_block (time_ms, value);
+        return;
+    }
+
+    int64_t delta = time_ms - prev_time_;
+    uint8_t encoded[20];
+    size_t len = put_varint (encoded, zigzag (delta - prev_delta_));
+    len += put_varint (encoded + len, zigzag ((int64_t)value - prev_value_));
+
+    if (b->used + len > data_capacity)
+    {
+        // the block is final, write it out once
+        sync_block (current);
+        start_block (time_ms, value);
+        return;
+    }
+
+    std::memcpy (current + sizeof (BlockHeader) + b->used, encoded, len);
+    b->used += len;
+    b->last_time = time_ms;
+    b->count++;
+
+    prev_time_ = time_ms;
+    prev_delta_ = delta;
+    prev_value_ = value;
+}
+
+/**
+ * Returns all samples with from_ms <= time_ms <= to_ms, sorted by time
+ */
+std::vector<Sample>
+SeriesStore::range (int64_t from_ms, int64_t to_ms) const
+{
+    std::lock_guard<std::mutex> lock (mutex_);
+    std::vector<Sample> ret;
+
+    auto collect = [&] (const BlockHeader *b) {
+        decode_block (b, [&] (int64_t time, int32_t value, int64_t) {
+            if (time >= from_ms && time <= to_ms)
+            {
+                ret.push_back ({ time, value });
+            }
+        });
+    };
+
+    if (!ordered_)
+    {
+        for (uint64_t i = 0; i < block_count (); i++)
+        {
+            const BlockHeader *b = block_header (block (i));
+            if (b->last_time >= from_ms && b->first_time <= to_ms)
+            {
+                collect (b);
+            }
+        }
+        std::stable_sort (ret.begin (), ret.end (),
+                          [] (const Sample &a, const Sample &b) { return a.time_ms < b.time_ms; });
+        return ret;
+    }
+
+    // first block that ends at or after from_ms
+    uint64_t lo = 0, hi = block_count ();
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (block_header (block (mid))->last_time < from_ms)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (uint64_t i = lo; i < block_count (); i++)
+    {
+        const BlockHeader *b = block_header (block (i));
+        if (b->first_time > to_ms)
+        {
+            break;
+        }
+        collect (b);
+    }
+
+    return ret;
+}
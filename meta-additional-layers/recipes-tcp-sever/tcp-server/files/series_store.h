@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace server
+{
+
+/**
+ * One stored reading, value is the raw DS18B20 temperature in 1/16 degree
+ */
+struct Sample
+{
+    int64_t time_ms; // unix time
+    int32_t value;
+};
+
+/**
+ * Append only temperature history in a memory mapped file
+ *
+ * The file is a header block followed by fixed size data blocks. Each block
+ * starts with its first sample in plain form, every following sample is
+ * stored as two zigzag varints: the delta of the timestamp delta and the
+ * delta of the value. With a fixed sample period and a steady temperature
+ * a sample takes 2 bytes. Blocks record their time span, so range queries
+ * binary search the blocks and only decode the ones in range. A clock step
+ * backwards starts a new block, after that range queries scan all block
+ * headers.
+ *
+ * Appends only touch the current block. Pages are written back by the
+ * kernel's periodic writeback, a block is msync'ed once when it is full.
+ * Thread safe.
+ */
+class SeriesStore
+{
+  public:
+    static constexpr uint32_t block_size = 4096;
+    static constexpr uint32_t grow_blocks = 64; // file grows by 256 KiB
+
+    explicit SeriesStore (const std::string &path);
+    ~SeriesStore ();
+
+    SeriesStore (const SeriesStore &) = delete;
+    SeriesStore &operator= (const SeriesStore &) = delete;
+
+    void append (int64_t time_ms, int32_t value);
+    std::vector<Sample> range (int64_t from_ms, int64_t to_ms) const;
+
+  private:
+    uint8_t *block (uint64_t index) const;
+    uint64_t block_count () const;
+    uint64_t block_capacity () const;
+    void map (size_t size);
+    void grow ();
+    void start_block (int64_t time_ms, int32_t value);
+    void sync_block (uint8_t *block) const;
+    void recover ();
+
+    std::string path_;
+    int fd_ = -1;
+    uint8_t *base_ = nullptr;
+    size_t mapped_ = 0;
+
+    // encoder state of the current block
+    int64_t prev_time_ = 0;
+    int64_t prev_delta_ = 0;
+    int32_t prev_value_ = 0;
+
+    bool ordered_ = true; // blocks are sorted by time, none overlaps the next
+    long page_size_;
+
+    mutable std::mutex mutex_;
+};
+
+}